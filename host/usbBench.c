@@ -0,0 +1,626 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "usbSim.h"
+#include <xc.h>
+#include "usbTypes.h"
+#include "usb.h"
+#include "usbCDC.h"
+#include "usbUART.h"
+#include "usbRaw.h"
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+/*
+ * Benchmarks the stack built for the host against the emulated SIE and full-speed host in usbSim.c.
+ * make -C host bench builds and runs it for each interrupt mode, USB_FLAGS giving the rest of the
+ * configuration the same as for a target build. Run on its own, it takes usbBench [frames [repeats [work]]].
+ * Each benchmark runs its traffic for frames frames of bus time, 1000 by default, repeats times,
+ * 5 by default, with the main loop spending work nanoseconds, 5000 by default, on the application
+ * each pass, as usbSimLoopWork. The bus figures come from the emulated frame timing and are the same
+ * every run. The CPU time is the host's time in usbIRQ() and usbTask(), the least of the repeats,
+ * which is for comparing builds with and not an estimate of PIC18 cycles. The max wait is the longest,
+ * in the same host nanoseconds, that any transaction waited between the SIE completing it and
+ * the stack starting to service it. IRQs is the number of times usbIRQ() was taken and max IRQ the
+ * longest it took any one time. The maxima come from a second set of repeats with usbSimProbing on,
+ * and are taken after each wait and interrupt time has been taken as its least over those, so they
+ * include the cost of reading the host's clock once. The idle benchmark has nothing but SOFs on
+ * the bus, and its device time is per frame. Last comes the time usbIRQ() takes for a SOF alone,
+ * called directly BENCH_SOF_IRQS times over, likewise for a TRNIF alone where the interrupt services
+ * the data endpoints itself, and the time per byte of copying an EP0 and a data
+ * endpoint packet out of RAM BENCH_COPIES times over, both with the byte loop through the endpoint
+ * status that came before the copy kernels and with usbCopyFromMem(), each the least of the repeats.
+ * The burst benchmarks send BENCH_BURST_LEN packets at a time with a gap either side of
+ * USB_ADAPTIVE_IDLE_FRAMES between bursts, which is what decides whether adaptive polling stays polled.
+ * make -C host bench-legacy does the same with USB_BENCH_LEGACY_DISPATCH defined, so usbIRQ()
+ * dispatches through the if-chain the pending mask replaced, for timing the two against each other.
+ * The exit status is non-zero if the stack broke the protocol or corrupted data along the way.
+ */
+
+#define BENCH_BLOCK_LEN		64
+#define BENCH_RAW_LEN		512
+#define BENCH_ADDRESS		5
+#define BENCH_CTRL_XFERS	500
+#define BENCH_BURST_LEN		4
+#define BENCH_RESULTS		9
+#define BENCH_NO_RATE		0xFFFFFFFFU
+#define BENCH_SOF_IRQS		100000
+#define BENCH_COPIES		100000
+#define BENCH_COPY_SIZES	2
+
+typedef enum
+{
+	BENCH_IDLE,
+	BENCH_CDC_IN,
+	BENCH_CDC_OUT,
+	BENCH_RAW_IN,
+	BENCH_RAW_OUT
+} benchMode_t;
+
+typedef struct
+{
+	const char *name;
+	uint32_t frames;
+	uint32_t transactions;
+	uint32_t naks;
+	uint64_t bytes;
+	uint64_t deviceTime;
+	uint64_t maxWait;
+	uint32_t interrupts;
+	uint64_t maxIRQTime;
+	/* Control transfers made, to give a time per transfer, or BENCH_NO_RATE for no rate at all */
+	uint32_t xfers;
+} benchResult_t;
+
+typedef struct
+{
+	uint64_t *times;
+	uint32_t count;
+	uint32_t size;
+} benchSamples_t;
+
+/*
+ * The waits and interrupt times sampled in the benchmark running, and for each benchmark the least of
+ * every sample over the repeats. The emulation is deterministic, so each sample is of the same
+ * transaction or interrupt every time a benchmark runs, and the host preempting us would have to
+ * land on the same one every repeat to make it into the worst case.
+ */
+benchSamples_t benchSamples[USB_SIM_SAMPLES], benchLeast[BENCH_RESULTS][USB_SIM_SAMPLES];
+bool benchSampling;
+
+benchMode_t benchMode;
+uint8_t benchPattern[BENCH_RAW_LEN];
+uint8_t benchSink[BENCH_RAW_LEN];
+uint64_t benchReceived;
+uint32_t benchCorrupt;
+
+#ifdef USB_RAW_INTERFACE
+void benchRawDone(uint8_t *buffer, uint16_t len)
+{
+	(void)buffer;
+	if (benchMode == BENCH_RAW_OUT)
+		benchReceived += len;
+}
+#endif
+
+/* The application's main loop body, keeping the stack fed with data or drained of it */
+void benchLoop()
+{
+	uint16_t len;
+	switch (benchMode)
+	{
+		case BENCH_CDC_IN:
+			while (usbUARTSendBuffer(0, benchPattern, BENCH_BLOCK_LEN))
+				continue;
+			break;
+		case BENCH_CDC_OUT:
+			while ((len = usbUARTRead(0, benchSink, sizeof(benchSink))) != 0)
+				benchReceived += len;
+			break;
+#ifdef USB_RAW_INTERFACE
+		case BENCH_RAW_IN:
+			while (usbRawSubmitIn(benchPattern, BENCH_RAW_LEN, benchRawDone))
+				continue;
+			break;
+		case BENCH_RAW_OUT:
+			while (usbRawSubmitOut(benchSink, BENCH_RAW_LEN, benchRawDone))
+				continue;
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+void benchGrow(benchSamples_t *samples, const uint32_t count)
+{
+	if (count <= samples->size)
+		return;
+	samples->size = count > samples->size * 2 ? count : samples->size * 2;
+	samples->times = realloc(samples->times, samples->size * sizeof(uint64_t));
+	if (samples->times == NULL)
+		abort();
+}
+
+void benchSample(const usbSimSample_t sample, const uint64_t time)
+{
+	benchSamples_t *samples = &benchSamples[sample];
+	if (!benchSampling)
+		return;
+	benchGrow(samples, samples->count + 1);
+	samples->times[samples->count++] = time;
+}
+
+/* Folds the benchmark's samples into the least seen so far and returns the worst of those */
+uint64_t benchWorst(benchSamples_t *least, const benchSamples_t *samples, const uint32_t run)
+{
+	uint64_t worst = 0;
+	uint32_t i;
+	if (run == 0 || samples->count < least->count)
+	{
+		benchGrow(least, samples->count);
+		if (run == 0)
+			memcpy(least->times, samples->times, samples->count * sizeof(uint64_t));
+		least->count = samples->count;
+	}
+	for (i = 0; i < least->count; ++i)
+	{
+		if (samples->times[i] < least->times[i])
+			least->times[i] = samples->times[i];
+		if (least->times[i] > worst)
+			worst = least->times[i];
+	}
+	return worst;
+}
+
+void benchStart(benchResult_t *result, const char *name)
+{
+	uint8_t i;
+	for (i = 0; i < USB_SIM_SAMPLES; ++i)
+		benchSamples[i].count = 0;
+	benchSampling = true;
+	result->name = name;
+	result->frames = usbSimStats.frames;
+	result->transactions = usbSimStats.transactions;
+	result->naks = usbSimStats.naks;
+	result->bytes = usbSimStats.bytesIn + usbSimStats.bytesOut;
+	result->deviceTime = usbSimStats.deviceTime;
+	result->interrupts = usbSimStats.interrupts;
+	result->xfers = 0;
+	usbSimStats.maxWait = 0;
+	usbSimStats.maxIRQTime = 0;
+}
+
+void benchStop(benchResult_t *result)
+{
+	benchSampling = false;
+	result->frames = usbSimStats.frames - result->frames;
+	result->transactions = usbSimStats.transactions - result->transactions;
+	result->naks = usbSimStats.naks - result->naks;
+	result->bytes = usbSimStats.bytesIn + usbSimStats.bytesOut - result->bytes;
+	result->deviceTime = usbSimStats.deviceTime - result->deviceTime;
+	result->maxWait = usbSimStats.maxWait;
+	result->interrupts = usbSimStats.interrupts - result->interrupts;
+	result->maxIRQTime = usbSimStats.maxIRQTime;
+}
+
+/* Reads whatever the device still has queued to send on ep, until it NAKs for a whole frame */
+void benchDrainIn(const uint8_t ep)
+{
+	uint8_t packet[64], len;
+	uint32_t frame;
+	benchMode = BENCH_IDLE;
+	/* Done once a whole frame has gone by with nothing left to read */
+	frame = usbSimStats.frames;
+	while (usbSimStats.frames <= frame + 1)
+	{
+		if (usbSimIn(ep, packet, &len) == USB_SIM_ACK)
+			frame = usbSimStats.frames;
+	}
+}
+
+bool benchBulkIn(benchResult_t *result, const char *name, const benchMode_t mode, const uint8_t ep, const uint32_t frames)
+{
+	uint8_t packet[64], len;
+	uint32_t end;
+	usbSimResult_t status;
+	/* Every write is the whole pattern block, so the stream must repeat it */
+	const uint16_t block = mode == BENCH_RAW_IN ? BENCH_RAW_LEN : BENCH_BLOCK_LEN;
+	uint16_t offset = 0;
+
+	benchMode = mode;
+	benchLoop();
+	benchStart(result, name);
+	end = usbSimStats.frames + frames;
+	while (usbSimStats.frames < end)
+	{
+		status = usbSimIn(ep, packet, &len);
+		if (status == USB_SIM_STALL)
+			return false;
+		else if (status != USB_SIM_ACK)
+			continue;
+		if (memcmp(packet, benchPattern + offset, len) != 0)
+			++benchCorrupt;
+		offset = (offset + len) % block;
+	}
+	benchStop(result);
+	benchDrainIn(ep);
+	return true;
+}
+
+bool benchBulkOut(benchResult_t *result, const char *name, const benchMode_t mode, const uint8_t ep, const uint32_t frames)
+{
+	uint32_t end;
+	uint64_t sent;
+
+	benchMode = mode;
+	benchReceived = 0;
+	benchLoop();
+	benchStart(result, name);
+	sent = usbSimStats.bytesOut;
+	end = usbSimStats.frames + frames;
+	while (usbSimStats.frames < end)
+	{
+		if (usbSimOut(ep, benchPattern, BENCH_BLOCK_LEN) == USB_SIM_STALL)
+			return false;
+	}
+	benchStop(result);
+	/* Give the application the chance to take the last of it */
+	usbSimIdle(2);
+	benchMode = BENCH_IDLE;
+	/* Transfers still queued when the traffic stopped will not have completed yet */
+	if (mode == BENCH_CDC_OUT && benchReceived != usbSimStats.bytesOut - sent)
+		++benchCorrupt;
+	return true;
+}
+
+/*
+ * Sends BENCH_BURST_LEN packets to the CDC port at a time, gap frames apart, as a command and
+ * response protocol might, and checks they all arrive.
+ */
+bool benchBursts(benchResult_t *result, const char *name, const uint32_t gap, const uint32_t frames)
+{
+	const uint8_t ep = USB_EP_CDC_DATA(0);
+	usbSimResult_t status;
+	uint32_t end, next;
+	uint64_t sent;
+	uint8_t i;
+
+	benchMode = BENCH_CDC_OUT;
+	benchReceived = 0;
+	benchStart(result, name);
+	sent = usbSimStats.bytesOut;
+	end = usbSimStats.frames + frames;
+	while (usbSimStats.frames < end)
+	{
+		next = usbSimStats.frames + gap;
+		for (i = 0; i < BENCH_BURST_LEN; ++i)
+		{
+			while ((status = usbSimOut(ep, benchPattern, BENCH_BLOCK_LEN)) == USB_SIM_NAK)
+				continue;
+			if (status != USB_SIM_ACK)
+				return false;
+		}
+		while (usbSimStats.frames < next)
+			usbSimFrame();
+	}
+	benchStop(result);
+	benchMode = BENCH_IDLE;
+	if (benchReceived != usbSimStats.bytesOut - sent)
+		++benchCorrupt;
+	return true;
+}
+
+#if !defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)
+/*
+ * Times usbIRQ() taken for nothing but a SOF, the commonest interrupt there is, over a batch
+ * so the clock's own cost drops out. Returns the nanoseconds each took.
+ */
+double benchSOFIRQ()
+{
+	uint64_t start, time;
+	uint32_t i;
+
+	start = usbSimNow();
+	for (i = 0; i < BENCH_SOF_IRQS; ++i)
+	{
+		UIRbits.SOFIF = 1;
+		usbIRQ();
+	}
+	time = usbSimNow() - start;
+	/* Let deferred mode catch up on the SOFs it queued */
+	usbTask();
+	return (double)time / BENCH_SOF_IRQS;
+}
+#endif
+
+#if (!defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)) && (!defined(USB_DEFERRED_IRQ) || defined(USB_SPLIT_IRQ))
+/*
+ * Times usbIRQ() taken for nothing but a completed IN on the first port's notification endpoint
+ * with no notification to follow it, the cheapest transaction there is to service, batched the
+ * same as benchSOFIRQ(). The batch is even so the endpoint's ping-pong state ends where it started.
+ */
+double benchTRNIRQ()
+{
+	uint64_t start, time;
+	uint32_t i;
+
+	start = usbSimNow();
+	for (i = 0; i < BENCH_SOF_IRQS; ++i)
+	{
+		USTAT = (USB_EP_CDC_NOTIFY(0) << 3) | (USB_DIR_IN << 2);
+		UIRbits.TRNIF = 1;
+		usbIRQ();
+	}
+	time = usbSimNow() - start;
+	return (double)time / BENCH_SOF_IRQS;
+}
+#endif
+
+/*
+ * The copy usbServiceEPWrite() did before the copy kernels, through the endpoint status's
+ * own pointer, kept out of line so it is called the same way as usbCopyFromMem().
+ */
+__attribute__((noinline)) void benchCopyBytes(volatile uint8_t *dst, usbEPStatus_t *epStatus, uint8_t count)
+{
+	while (count--)
+		*dst++ = *epStatus->buffer.memBuff++;
+}
+
+/*
+ * Times copying count bytes out of RAM BENCH_COPIES times over, either with usbCopyFromMem() or the
+ * old byte loop in benchCopyBytes(). Returns the nanoseconds each byte took.
+ */
+double benchCopy(const uint8_t count, const bool kernel)
+{
+	static uint8_t src[USB_CDC_DATA_LEN];
+	static volatile uint8_t dst[USB_CDC_DATA_LEN];
+	usbEPStatus_t epStatus;
+	uint64_t start, time;
+	uint32_t i;
+
+	start = usbSimNow();
+	for (i = 0; i < BENCH_COPIES; ++i)
+	{
+		if (kernel)
+			usbCopyFromMem(dst, src, count);
+		else
+		{
+			epStatus.buffer.memBuff = src;
+			benchCopyBytes(dst, &epStatus, count);
+		}
+	}
+	time = usbSimNow() - start;
+	return (double)time / ((uint64_t)BENCH_COPIES * count);
+}
+
+bool benchControlXfers(benchResult_t *result, const uint32_t count)
+{
+	uint8_t data[18];
+	uint32_t i;
+	benchStart(result, "control GET_DESCRIPTOR");
+	for (i = 0; i < count; ++i)
+	{
+		if (usbSimGetDescriptor(USB_DESCRIPTOR_DEVICE, 0, sizeof(data), data) != USB_SIM_ACK)
+			return false;
+	}
+	benchStop(result);
+	result->xfers = count;
+	return true;
+}
+
+bool benchEnumeration(benchResult_t *result)
+{
+	benchStart(result, "enumeration");
+	if (!usbSimEnumerate(BENCH_ADDRESS))
+		return false;
+	benchStop(result);
+	result->xfers = BENCH_NO_RATE;
+	return true;
+}
+
+/* Lets the bus idle, so the only interrupts are SOFs */
+void benchIdle(benchResult_t *result, const uint32_t frames)
+{
+	benchStart(result, "idle");
+	usbSimIdle(frames);
+	benchStop(result);
+	result->xfers = BENCH_NO_RATE;
+}
+
+/*
+ * Keeps the run with the least device time, the bus figures being the same for every run. The worst
+ * wait and interrupt time come from the repeats run with probing on, once each has been taken as its
+ * least over those.
+ */
+void benchKeep(benchResult_t *results, uint8_t *count, const benchResult_t *result, const uint32_t run)
+{
+	const uint8_t index = (*count)++;
+	benchResult_t *best = &results[index];
+	if (!usbSimProbing)
+	{
+		if (run == 0 || result->deviceTime < best->deviceTime)
+			*best = *result;
+		return;
+	}
+	best->maxWait = benchWorst(&benchLeast[index][USB_SIM_SAMPLE_WAIT], &benchSamples[USB_SIM_SAMPLE_WAIT], run);
+	best->maxIRQTime = benchWorst(&benchLeast[index][USB_SIM_SAMPLE_IRQ], &benchSamples[USB_SIM_SAMPLE_IRQ], run);
+}
+
+void benchPrint(const benchResult_t *result)
+{
+	/* With no transactions at all, the device time is given per frame */
+	const uint32_t events = result->transactions != 0 ? result->transactions : result->frames;
+	printf("%-24s %8u %12u %8u ", result->name, result->frames, result->transactions, result->naks);
+	if (result->xfers == BENCH_NO_RATE)
+		printf("%15s", "");
+	else if (result->xfers != 0)
+		printf("%8.2f ms/xfer", (double)result->frames / result->xfers);
+	else
+		printf("%8.1f kB/s   ", (double)result->bytes / result->frames);
+	printf(" %8.1f %9" PRIu64 " %8u %8" PRIu64 "\n", (double)result->deviceTime / events, result->maxWait,
+		result->interrupts, result->maxIRQTime);
+}
+
+const char *benchModeName()
+{
+#if defined(USB_SPLIT_IRQ)
+	return "split";
+#elif defined(USB_DEFERRED_IRQ)
+	return "deferred";
+#elif defined(USB_ADAPTIVE_POLL)
+	return "adaptive polled";
+#elif defined(USB_POLLED)
+	return "polled";
+#else
+	return "interrupt";
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	const uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+	const uint32_t repeats = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+	const uint32_t shortGap = USB_ADAPTIVE_IDLE_FRAMES / 2, longGap = USB_ADAPTIVE_IDLE_FRAMES * 2;
+	char shortName[32], longName[32];
+	benchResult_t results[BENCH_RESULTS], result;
+	uint8_t count = 0, pass;
+	uint32_t run;
+	double time;
+#if !defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)
+	double sofIRQ = 0;
+#endif
+#if (!defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)) && (!defined(USB_DEFERRED_IRQ) || defined(USB_SPLIT_IRQ))
+	double trnIRQ = 0;
+#endif
+	const uint8_t copySizes[BENCH_COPY_SIZES] = {USB_EP0_DATA_LEN, USB_CDC_DATA_LEN};
+	double copyTimes[BENCH_COPY_SIZES][2];
+	uint8_t copy, kernel;
+	uint16_t i;
+
+	for (i = 0; i < sizeof(benchPattern); ++i)
+		benchPattern[i] = i * 7 + 1;
+	snprintf(shortName, sizeof(shortName), "CDC OUT bursts, gap %u", shortGap);
+	snprintf(longName, sizeof(longName), "CDC OUT bursts, gap %u", longGap);
+
+	usbSimInit(benchLoop);
+	usbSimSampled = benchSample;
+	usbSimLoopWork = argc > 3 ? strtoul(argv[3], NULL, 10) : 5000;
+	usbInit();
+	if (!usbCanAttach())
+		return 1;
+	usbAttach();
+	/* Give the device the 100ms a host waits after seeing it connect */
+	usbSimIdle(100);
+
+	/* Once for the device time, and again with probing on for the worst cases */
+	for (pass = 0; pass < 2; ++pass)
+	{
+		usbSimProbing = pass == 1;
+		for (run = 0; run < repeats; ++run)
+		{
+			count = 0;
+			if (!benchEnumeration(&result))
+				return 1;
+			benchKeep(results, &count, &result, run);
+			benchIdle(&result, frames);
+			benchKeep(results, &count, &result, run);
+#if !defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)
+			time = benchSOFIRQ();
+			if (!usbSimProbing && (run == 0 || time < sofIRQ))
+				sofIRQ = time;
+#endif
+#if (!defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)) && (!defined(USB_DEFERRED_IRQ) || defined(USB_SPLIT_IRQ))
+			time = benchTRNIRQ();
+			if (!usbSimProbing && (run == 0 || time < trnIRQ))
+				trnIRQ = time;
+#endif
+			for (copy = 0; copy < BENCH_COPY_SIZES; ++copy)
+			{
+				for (kernel = 0; kernel < 2; ++kernel)
+				{
+					time = benchCopy(copySizes[copy], kernel);
+					if (!usbSimProbing && (run == 0 || time < copyTimes[copy][kernel]))
+						copyTimes[copy][kernel] = time;
+				}
+			}
+			if (!benchControlXfers(&result, BENCH_CTRL_XFERS))
+				return 1;
+			benchKeep(results, &count, &result, run);
+			if (!benchBulkIn(&result, "CDC bulk IN", BENCH_CDC_IN, USB_EP_CDC_DATA(0), frames))
+				return 1;
+			benchKeep(results, &count, &result, run);
+			if (!benchBulkOut(&result, "CDC bulk OUT", BENCH_CDC_OUT, USB_EP_CDC_DATA(0), frames))
+				return 1;
+			benchKeep(results, &count, &result, run);
+			if (!benchBursts(&result, shortName, shortGap, frames))
+				return 1;
+			benchKeep(results, &count, &result, run);
+			if (!benchBursts(&result, longName, longGap, frames))
+				return 1;
+			benchKeep(results, &count, &result, run);
+#ifdef USB_RAW_INTERFACE
+			if (!benchBulkIn(&result, "raw bulk IN", BENCH_RAW_IN, USB_EP_RAW, frames))
+				return 1;
+			benchKeep(results, &count, &result, run);
+			if (!benchBulkOut(&result, "raw bulk OUT", BENCH_RAW_OUT, USB_EP_RAW, frames))
+				return 1;
+			benchKeep(results, &count, &result, run);
+#endif
+		}
+	}
+
+	printf("%s mode%s, %u CDC port(s), %u frames of traffic, %u ns of loop work, best of %u\n",
+		benchModeName(),
+#ifdef USB_BENCH_LEGACY_DISPATCH
+		" with the legacy if-chain dispatch",
+#else
+		"",
+#endif
+		USB_CDC_PORTS, frames, usbSimLoopWork, repeats);
+	printf("%-24s %8s %12s %8s %15s %8s %9s %8s %8s\n", "benchmark", "frames", "transactions", "NAKs",
+		"rate", "ns/xact", "max wait", "IRQs", "max IRQ");
+	for (i = 0; i < count; ++i)
+		benchPrint(&results[i]);
+#if !defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)
+	printf("usbIRQ() for a SOF alone: %.1f ns\n", sofIRQ);
+#endif
+#if (!defined(USB_POLLED) || defined(USB_ADAPTIVE_POLL)) && (!defined(USB_DEFERRED_IRQ) || defined(USB_SPLIT_IRQ))
+	printf("usbIRQ() for a TRNIF alone: %.1f ns\n", trnIRQ);
+#endif
+	for (copy = 0; copy < BENCH_COPY_SIZES; ++copy)
+		printf("%u byte copy: %.2f ns/byte byte loop, %.2f ns/byte usbCopyFromMem()\n",
+			copySizes[copy], copyTimes[copy][0], copyTimes[copy][1]);
+
+	if (usbSimStats.toggleErrors != 0 || usbSimStats.overruns != 0 || benchCorrupt != 0)
+	{
+		printf("protocol faults: %u data toggle errors, %u overruns, %u corrupted transfers\n",
+			usbSimStats.toggleErrors, usbSimStats.overruns, benchCorrupt);
+		return 1;
+	}
+	return 0;
+}
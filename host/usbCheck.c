@@ -0,0 +1,913 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbSim.h"
+#include <xc.h>
+#include "usbTypes.h"
+#include "usb.h"
+#include "usbCDC.h"
+#include "usbUART.h"
+#include "usbRaw.h"
+#include "usbStats.h"
+#include "usbProfile.h"
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+/*
+ * Behavioural checks of the stack built for the host against the emulated SIE in usbSim.c. Each check
+ * drives the device from the emulated host's side and calls the application API directly in between,
+ * which is safe as the device only runs when a bus event hands it control. host/Makefile builds and
+ * runs these for each interrupt mode with the optional features enabled. The exit status is the number of failures.
+ */
+
+#define CHECK_ADDRESS		7
+/* Frames the host keeps reading for after the last packet, which covers the CDC flush deadline */
+#define CHECK_QUIET_FRAMES	4
+#define CHECK_MAX_PACKETS	16
+/* Where the application's own USB RAM buffer goes, after the stack's */
+#ifdef USB_RAW_INTERFACE
+#define CHECK_RAM_ADDR		USB_RAW_RAM_END
+#else
+#define CHECK_RAM_ADDR		USB_CDC_RAM_END
+#endif
+#define CHECK_RAM_LEN		64
+
+uint32_t checkFailures;
+uint32_t checkRuns;
+
+bool checkFail(const char *check, const char *what)
+{
+	fprintf(stderr, "usbCheck: %s: %s\n", check, what);
+	++checkFailures;
+	return false;
+}
+
+/*
+ * Reads ep until it has NAKed for CHECK_QUIET_FRAMES frames, recording the length of each packet
+ * in lens and the data in data. Returns the number of packets read.
+ */
+uint8_t checkReadIn(const uint8_t ep, uint8_t *data, uint8_t *lens)
+{
+	uint8_t packet[64], len, count = 0;
+	uint32_t frame = usbSimStats.frames;
+	uint16_t offset = 0;
+
+	while (usbSimStats.frames <= frame + CHECK_QUIET_FRAMES)
+	{
+		if (usbSimIn(ep, packet, &len) != USB_SIM_ACK)
+			continue;
+		frame = usbSimStats.frames;
+		if (count == CHECK_MAX_PACKETS)
+			break;
+		lens[count++] = len;
+		memcpy(data + offset, packet, len);
+		offset += len;
+	}
+	return count;
+}
+
+/*
+ * Checks ep sends the len bytes at expected as the packets whose lengths are given by
+ * the count values following it, the last of which may be 0 for a ZLP.
+ */
+bool checkPackets(const char *check, const uint8_t ep, const uint8_t *expected, const uint16_t len,
+	const uint8_t count, const uint8_t *packetLens)
+{
+	uint8_t data[CHECK_MAX_PACKETS * 64], lens[CHECK_MAX_PACKETS];
+	uint8_t read = checkReadIn(ep, data, lens);
+
+	++checkRuns;
+	if (read != count || memcmp(lens, packetLens, count) != 0)
+	{
+		uint8_t i;
+		fprintf(stderr, "usbCheck: %s: got %u packets of", check, read);
+		for (i = 0; i < read; ++i)
+			fprintf(stderr, " %u", lens[i]);
+		fprintf(stderr, ", expected %u of", count);
+		for (i = 0; i < count; ++i)
+			fprintf(stderr, " %u", packetLens[i]);
+		fprintf(stderr, "\n");
+		++checkFailures;
+		return false;
+	}
+	if (memcmp(data, expected, len) != 0)
+		return checkFail(check, "the data sent was corrupted");
+	return true;
+}
+
+#ifdef USB_RAW_INTERFACE
+uint16_t checkRawDoneLen;
+
+void checkRawDone(uint8_t *buffer, uint16_t len)
+{
+	(void)buffer;
+	checkRawDoneLen = len;
+}
+#endif
+
+/* Transfers that end on a packet boundary are terminated with a ZLP, but only when nothing follows them */
+void checkZLP()
+{
+	uint8_t data[128];
+	uint8_t i;
+	const uint8_t one[] = { USB_CDC_DATA_LEN, 0 };
+	const uint8_t two[] = { USB_CDC_DATA_LEN, USB_CDC_DATA_LEN, 0 };
+	const uint8_t rawTwo[] = { 64, 64, 0 };
+	const uint8_t shortEnd[] = { 64, 36 };
+	const uint8_t partial[] = { 10 };
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = i * 3 + 5;
+
+	/* The CDC transmit stream sends a full slot at once and a part filled one on its flush deadline */
+	if (!usbUARTSendBuffer(0, data, USB_CDC_DATA_LEN))
+		checkFail("CDC ZLP", "a full packet write was refused");
+	checkPackets("CDC ZLP after one packet", USB_EP_CDC_DATA(0), data, USB_CDC_DATA_LEN, sizeof(one), one);
+	/* Slots filled back to back go out as one transfer, with just the one ZLP at the end */
+	if (!usbUARTSendBuffer(0, data, 2 * USB_CDC_DATA_LEN))
+		checkFail("CDC ZLP", "a two packet write was refused");
+	checkPackets("CDC ZLP after two packets", USB_EP_CDC_DATA(0), data, 2 * USB_CDC_DATA_LEN, sizeof(two), two);
+	if (!usbUARTSendBuffer(0, data, 10))
+		checkFail("CDC ZLP", "a 10 byte write was refused");
+	checkPackets("CDC short packet", USB_EP_CDC_DATA(0), data, 10, sizeof(partial), partial);
+
+#ifdef USB_RAW_INTERFACE
+	checkRawDoneLen = 0;
+	if (!usbRawSubmitIn(data, 128, checkRawDone))
+		checkFail("raw ZLP", "a 128 byte transfer was refused");
+	if (checkPackets("raw ZLP", USB_EP_RAW, data, 128, sizeof(rawTwo), rawTwo) && checkRawDoneLen != 128)
+		checkFail("raw ZLP", "the transfer did not complete");
+	checkRawDoneLen = 0;
+	if (!usbRawSubmitIn(data, 100, checkRawDone))
+		checkFail("raw ZLP", "a 100 byte transfer was refused");
+	if (checkPackets("raw short packet", USB_EP_RAW, data, 100, sizeof(shortEnd), shortEnd) && checkRawDoneLen != 100)
+		checkFail("raw short packet", "the transfer did not complete");
+#else
+	(void)rawTwo;
+	(void)shortEnd;
+#endif
+}
+
+#if CHECK_RAM_ADDR + CHECK_RAM_LEN <= USB_RAM_END
+volatile uint8_t checkRAM[CHECK_RAM_LEN];
+uint8_t checkSent;
+
+void checkSentDone()
+{
+	++checkSent;
+}
+
+/* A short USB RAM buffer is packed into the transmit stream along with the writes either side of it */
+void checkCoalesce()
+{
+	const uint8_t packed[] = { 18 };
+	uint8_t i;
+
+	usbSimMap(checkRAM, CHECK_RAM_ADDR, CHECK_RAM_LEN);
+	for (i = 0; i < 10; ++i)
+		checkRAM[i] = '0' + i;
+	checkSent = 0;
+	usbUARTSetSentCallback(0, checkSentDone);
+	if (!usbUARTSendStringM(0, "abc") || !usbUARTSendBuffer(0, (uint8_t *)checkRAM, 10) ||
+		!usbUARTSendStringM(0, "defgh"))
+		checkFail("CDC coalescing", "a write was refused");
+	if (checkPackets("CDC coalescing", USB_EP_CDC_DATA(0), (const uint8_t *)"abc0123456789defgh", 18,
+		sizeof(packed), packed))
+	{
+		++checkRuns;
+		if (checkSent != 1)
+			checkFail("CDC coalescing", "the sent callback did not run once");
+	}
+	usbUARTSetSentCallback(0, NULL);
+}
+#endif
+
+uint8_t checkGatherDone;
+
+void checkGatherComplete()
+{
+	++checkGatherDone;
+}
+
+/* Gathered writes go out whole and complete to their own callback without upsetting the endpoint owner's */
+void checkGather()
+{
+	static uint8_t ram[30];
+	static const uint8_t flash[34] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	const usbSegment_t segments[] =
+	{
+		{ USB_BUFFER_SRC_MEM, ram, sizeof(ram) },
+		{ USB_BUFFER_SRC_FLASH, flash, sizeof(flash) }
+	};
+	uint8_t expected[sizeof(ram) + sizeof(flash)];
+#if USB_CDC_DATA_LEN == 64
+	const uint8_t cdc[] = { 64, 0 };
+#else
+	const uint8_t cdc[] = { 32, 32, 0 };
+#endif
+	uint8_t i;
+
+	for (i = 0; i < sizeof(ram); ++i)
+		ram[i] = i + 100;
+	memcpy(expected, ram, sizeof(ram));
+	memcpy(expected + sizeof(ram), flash, sizeof(flash));
+
+	if (!usbUARTSendSegments(0, segments, 2))
+		checkFail("CDC gather", "the write was refused");
+	checkPackets("CDC gather", USB_EP_CDC_DATA(0), expected, sizeof(expected), sizeof(cdc), cdc);
+
+#ifdef USB_RAW_INTERFACE
+	{
+		const uint8_t raw[] = { 64, 10 };
+		checkGatherDone = 0;
+		checkRawDoneLen = 0;
+		if (!usbServiceEPWriteGather(USB_EP_RAW, segments, 2, checkGatherComplete))
+			checkFail("raw gather", "the transfer was refused");
+		/* A transfer queued behind the gathered one follows it out, in place of its ZLP */
+		if (!usbRawSubmitIn(expected, 10, checkRawDone))
+			checkFail("raw gather", "a transfer after it was refused");
+		if (checkPackets("raw gather", USB_EP_RAW, expected, sizeof(expected), sizeof(raw), raw))
+		{
+			++checkRuns;
+			if (checkGatherDone != 1)
+				checkFail("raw gather", "the gathered transfer did not complete once");
+			else if (checkRawDoneLen != 10)
+				checkFail("raw gather", "the transfer after it did not complete to its own callback");
+		}
+	}
+#endif
+}
+
+/* Each conversion formats into the stream, carries on across slot boundaries and stops where the slots run out */
+void checkPrintf()
+{
+	static char text[USB_CDC_IN_SLOTS * USB_CDC_DATA_LEN + 17];
+	static const char conversions[] = "-42 40000 beef BEEF -00017 12.34 x str 100%";
+	const uint8_t wrapped[] = { USB_CDC_DATA_LEN, 6 };
+	uint8_t lens[USB_CDC_IN_SLOTS + 1], count = 0;
+	uint16_t i;
+
+	if (!usbUARTPrintf(0, "%d %u %x %lX %06d %.2d %c %s %u%%", -42, 40000U, 0xBEEFU, 0xBEEFUL, -17, 1234, 'x',
+		"str", 100U))
+		checkFail("usbUARTPrintf", "the output was cut short");
+	/* The line is longer than a 32 byte packet, so it can take two */
+	for (i = sizeof(conversions) - 1; i >= USB_CDC_DATA_LEN; i -= USB_CDC_DATA_LEN)
+		lens[count++] = USB_CDC_DATA_LEN;
+	lens[count++] = i;
+	checkPackets("usbUARTPrintf conversions", USB_EP_CDC_DATA(0), (const uint8_t *)conversions,
+		sizeof(conversions) - 1, count, lens);
+
+	/* A number that starts in one slot and finishes in the next */
+	memset(text, 'p', USB_CDC_DATA_LEN - 3);
+	text[USB_CDC_DATA_LEN - 3] = 0;
+	if (!usbUARTPrintf(0, "%s%ld", text, 123456789L))
+		checkFail("usbUARTPrintf across slots", "the output was cut short");
+	strcat(text, "123456789");
+	checkPackets("usbUARTPrintf across slots", USB_EP_CDC_DATA(0), (const uint8_t *)text, USB_CDC_DATA_LEN + 6,
+		sizeof(wrapped), wrapped);
+
+	/* More than every slot holds with nothing being read is cut off where the last slot fills */
+	for (i = 0; i < sizeof(text) - 1; ++i)
+		text[i] = 'A' + i % 26;
+	text[i] = 0;
+	++checkRuns;
+	if (usbUARTPrintf(0, "%s", text))
+		checkFail("usbUARTPrintf past the last slot", "reported the whole output sent");
+	for (i = 0; i < USB_CDC_IN_SLOTS; ++i)
+		lens[i] = USB_CDC_DATA_LEN;
+	lens[i] = 0;
+	checkPackets("usbUARTPrintf past the last slot", USB_EP_CDC_DATA(0), (const uint8_t *)text,
+		USB_CDC_IN_SLOTS * USB_CDC_DATA_LEN, sizeof(lens), lens);
+}
+
+bool checkControlLines(const char *check, const uint8_t port, const uint16_t lines)
+{
+	++checkRuns;
+	if (usbSimRequest(0x21, USB_REQUEST_SET_CONTROL_LINE, lines, USB_IFACE_CDC_COMM(port), 0, NULL) != USB_SIM_ACK)
+		return checkFail(check, "SET_CONTROL_LINE_STATE failed");
+	return true;
+}
+
+/* CDC class requests are only answered when addressed to one of the ports' interfaces */
+void checkClassRequests()
+{
+	const uint8_t lines = usbUARTControlLines(0);
+	const uint8_t coding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };
+	uint8_t read[7];
+
+	++checkRuns;
+	if (usbSimRequest(0x20, USB_REQUEST_SET_CONTROL_LINE, 0, USB_IFACE_CDC_COMM(0), 0, NULL) != USB_SIM_STALL)
+		checkFail("SET_CONTROL_LINE_STATE to the device", "was not stalled");
+	if (usbSimRequest(0x22, USB_REQUEST_SET_CONTROL_LINE, 0, USB_IFACE_CDC_COMM(0), 0, NULL) != USB_SIM_STALL)
+		checkFail("SET_CONTROL_LINE_STATE to an endpoint", "was not stalled");
+	if (usbSimRequest(0x21, USB_REQUEST_SET_CONTROL_LINE, 0, USB_IFACE_CDC_COMM(USB_CDC_PORTS), 0, NULL) !=
+		USB_SIM_STALL)
+		checkFail("SET_CONTROL_LINE_STATE past the last port", "was not stalled");
+	if (usbUARTControlLines(0) != lines)
+		checkFail("CDC class request recipients", "a stalled request changed the control lines");
+
+	/* A request with an IN data stage straight after one with an OUT data stage reads the new SETUP, not the old */
+	++checkRuns;
+	if (usbSimRequest(0x21, USB_REQUEST_SET_LINE_CODING, 0, USB_IFACE_CDC_COMM(0), sizeof(coding), (void *)coding) !=
+			USB_SIM_ACK ||
+		usbSimRequest(0xA1, USB_REQUEST_GET_LINE_CODING, 0, USB_IFACE_CDC_COMM(0), sizeof(read), read) != USB_SIM_ACK)
+		checkFail("GET_LINE_CODING after SET_LINE_CODING", "the request failed");
+	else if (memcmp(read, coding, sizeof(coding)) != 0)
+		checkFail("GET_LINE_CODING after SET_LINE_CODING", "did not return the line coding set");
+}
+
+/* Fills in the SERIAL_STATE notification expected from port with the state bitmap given */
+void checkNotification(uint8_t *notification, const uint8_t port, const uint8_t state)
+{
+	const uint8_t header[] = { USB_CDC_NOTIFY_REQUEST_TYPE, USB_CDC_NOTIFY_SERIAL_STATE, 0, 0,
+		USB_IFACE_CDC_COMM(port), 0, 2, 0 };
+	memcpy(notification, header, sizeof(header));
+	notification[8] = state;
+	notification[9] = 0;
+}
+
+/*
+ * Line state goes out on each port's notification endpoint, and events raised while a notification
+ * is in flight are merged into the one after it
+ */
+void checkSerialState()
+{
+	const uint8_t levels = USB_UART_STATE_DCD | USB_UART_STATE_DSR;
+	const uint8_t two[] = { sizeof(usbCDCNotification_t), sizeof(usbCDCNotification_t) };
+	uint8_t expected[2 * sizeof(usbCDCNotification_t)];
+	uint8_t port;
+
+	for (port = 0; port < USB_CDC_PORTS; ++port)
+	{
+		usbUARTSetSerialLevels(port, levels);
+		usbUARTSignalSerialEvents(port, USB_UART_STATE_BREAK);
+		usbUARTSignalSerialEvents(port, USB_UART_STATE_RING);
+		checkNotification(expected, port, levels);
+		checkNotification(expected + sizeof(usbCDCNotification_t), port,
+			levels | USB_UART_STATE_BREAK | USB_UART_STATE_RING);
+		checkPackets("SERIAL_STATE", USB_EP_CDC_NOTIFY(port), expected, sizeof(expected), sizeof(two), two);
+
+		usbUARTSetSerialLevels(port, 0);
+		checkNotification(expected, port, 0);
+		checkPackets("SERIAL_STATE levels cleared", USB_EP_CDC_NOTIFY(port), expected,
+			sizeof(usbCDCNotification_t), 1, two);
+	}
+}
+
+/* Writes go out with DTR low unless the application asks for them to be held back */
+void checkDTR()
+{
+	const uint8_t one[] = { 2 };
+	const uint8_t none[] = { 0 };
+	uint8_t data[] = "uv";
+
+	checkControlLines("DTR low", 0, 0);
+	if (!usbUARTSendStringM(0, "xy"))
+		checkFail("DTR low by default", "the write was refused");
+	checkPackets("DTR low by default", USB_EP_CDC_DATA(0), (const uint8_t *)"xy", 2, sizeof(one), one);
+
+	usbUARTSetDTRPolicy(0, USB_UART_DTR_KEEP);
+	if (!usbUARTSendStringM(0, "zz"))
+		checkFail("DTR low keeping", "the write was refused");
+	checkPackets("DTR low keeping", USB_EP_CDC_DATA(0), (const uint8_t *)"", 0, 0, none);
+	checkControlLines("DTR high", 0, USB_UART_LINE_DTR | USB_UART_LINE_RTS);
+	checkPackets("DTR high after keeping", USB_EP_CDC_DATA(0), (const uint8_t *)"zz", 2, sizeof(one), one);
+
+	/* Dropped writes count as sent and are gone for good */
+	usbUARTSetDTRPolicy(0, USB_UART_DTR_DROP);
+	checkControlLines("DTR low dropping", 0, 0);
+	if (!usbUARTSendBuffer(0, data, 2))
+		checkFail("DTR low dropping", "the write was refused");
+	checkPackets("DTR low dropping", USB_EP_CDC_DATA(0), (const uint8_t *)"", 0, 0, none);
+	checkControlLines("DTR high", 0, USB_UART_LINE_DTR | USB_UART_LINE_RTS);
+	checkPackets("DTR high after dropping", USB_EP_CDC_DATA(0), (const uint8_t *)"", 0, 0, none);
+
+	/* Blocked writes are refused until DTR rises, then go out as normal */
+	usbUARTSetDTRPolicy(0, USB_UART_DTR_BLOCK);
+	checkControlLines("DTR low blocking", 0, 0);
+	++checkRuns;
+	if (usbUARTSendBuffer(0, data, 2))
+		checkFail("DTR low blocking", "the write was accepted");
+	checkPackets("DTR low blocking", USB_EP_CDC_DATA(0), (const uint8_t *)"", 0, 0, none);
+	checkControlLines("DTR high", 0, USB_UART_LINE_DTR | USB_UART_LINE_RTS);
+	if (!usbUARTSendBuffer(0, data, 2))
+		checkFail("DTR high after blocking", "the write was refused");
+	checkPackets("DTR high after blocking", USB_EP_CDC_DATA(0), data, 2, sizeof(one), one);
+	usbUARTSetDTRPolicy(0, USB_UART_DTR_SEND);
+}
+
+/* Gathered writes held by the keep policy wrap its ring, keeping the newest USB_CDC_KEEP_LEN (by default 64) bytes */
+void checkDTRKeepSegments()
+{
+	static uint8_t ram[30];
+	static const uint8_t flash[50] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWX";
+	const usbSegment_t segments[] =
+	{
+		{ USB_BUFFER_SRC_MEM, ram, sizeof(ram) },
+		{ USB_BUFFER_SRC_FLASH, flash, sizeof(flash) }
+	};
+	uint8_t expected[3 + sizeof(ram) + sizeof(flash)];
+#if USB_CDC_DATA_LEN == 64
+	const uint8_t kept[] = { 64, 0 };
+#else
+	const uint8_t kept[] = { 32, 32, 0 };
+#endif
+	const uint8_t none[] = { 0 };
+	uint8_t i;
+
+	for (i = 0; i < sizeof(ram); ++i)
+		ram[i] = '0' + i;
+	memcpy(expected, "123", 3);
+	memcpy(expected + 3, ram, sizeof(ram));
+	memcpy(expected + 3 + sizeof(ram), flash, sizeof(flash));
+
+	usbUARTSetDTRPolicy(0, USB_UART_DTR_KEEP);
+	checkControlLines("DTR low keeping segments", 0, 0);
+	if (!usbUARTSendStringM(0, "123") || !usbUARTSendSegments(0, segments, 2))
+		checkFail("DTR low keeping segments", "a write was refused");
+	checkPackets("DTR low keeping segments", USB_EP_CDC_DATA(0), (const uint8_t *)"", 0, 0, none);
+	checkControlLines("DTR high", 0, USB_UART_LINE_DTR | USB_UART_LINE_RTS);
+	checkPackets("DTR high after keeping segments", USB_EP_CDC_DATA(0), expected + sizeof(expected) - 64, 64,
+		sizeof(kept), kept);
+	usbUARTSetDTRPolicy(0, USB_UART_DTR_SEND);
+}
+
+bool checkOut(const char *check, const uint8_t ep, const char *data, const uint8_t len)
+{
+	if (usbSimOut(ep, (const uint8_t *)data, len) != USB_SIM_ACK)
+		return checkFail(check, "the device did not accept a packet");
+	return true;
+}
+
+#if USB_CDC_PORTS > 1
+/* Traffic and control line changes on the last port leave the other ports' rings and DTR state alone */
+void checkPorts()
+{
+	const uint8_t last = USB_CDC_PORTS - 1;
+	const uint8_t opened = USB_UART_LINE_DTR | USB_UART_LINE_RTS;
+	const uint8_t one[] = { 3 };
+	const uint8_t none[] = { 0 };
+	uint8_t data[8], port;
+
+	checkControlLines("port isolation", last, 0);
+	checkOut("port isolation", USB_EP_CDC_DATA(last), "abc", 3);
+	if (!usbUARTSendStringM(last, "xyz"))
+		checkFail("port isolation", "the write was refused");
+
+	for (port = 0; port < last; ++port)
+	{
+		++checkRuns;
+		if (usbUARTControlLines(port) != opened)
+			checkFail("port isolation", "another port's control lines changed");
+		if (usbUARTHaveData(port))
+			checkFail("port isolation", "another port received the data");
+		checkPackets("port isolation", USB_EP_CDC_DATA(port), (const uint8_t *)"", 0, 0, none);
+	}
+
+	++checkRuns;
+	if (usbUARTControlLines(last) != 0)
+		checkFail("port isolation", "the port's control lines were not set");
+	if (usbUARTRead(last, data, sizeof(data)) != 3 || memcmp(data, "abc", 3) != 0)
+		checkFail("port isolation", "the port did not receive its data");
+	checkPackets("port isolation", USB_EP_CDC_DATA(last), (const uint8_t *)"xyz", 3, sizeof(one), one);
+	checkControlLines("port isolation", last, opened);
+}
+#endif
+
+#ifdef USB_CDC_UART_BRIDGE
+/*
+ * Takes the EUSART interrupt each time TXREG1 empties until the bridge stops writing it,
+ * collecting up to len bytes sent on the line into data. Returns how many there were.
+ */
+uint16_t checkBridgeDrain(uint8_t *data, const uint16_t len)
+{
+	uint16_t count = 0;
+
+	usbUARTBridgeIRQ();
+	while (count < len && usbSimUARTShift(&data[count]))
+	{
+		++count;
+		usbUARTBridgeIRQ();
+	}
+	return count;
+}
+
+/*
+ * The bridge is on port 0, the default: what the host sends goes out through TXREG1, slots being
+ * handed back to the host as they drain, and what arrives in RCREG1 comes back to the host in packets.
+ */
+void checkBridge()
+{
+	const uint8_t ep = USB_EP_CDC_DATA(0);
+	const uint8_t sevenEven[7] = { 0x00, 0xC2, 0x01, 0x00, 0, USB_CDC_PARITY_EVEN, 7 };
+	const uint8_t eightNone[7] = { 0x00, 0xC2, 0x01, 0x00, 0, USB_CDC_PARITY_NONE, 8 };
+	const uint8_t parity[] = { 'a' | 0x80, 'c', 0x7F | 0x80 };
+	const uint8_t rxLens[] = { USB_CDC_DATA_LEN, 10 };
+	const uint8_t none[] = { 0 };
+	uint8_t data[2 * USB_CDC_DATA_LEN + 10], sent[sizeof(data) + 1];
+	uint16_t i;
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = i * 7 + 1;
+
+	++checkRuns;
+	/* Two packets fill every slot on builds with two, and the third has to wait for one to drain */
+	checkOut("bridge to the UART", ep, (const char *)data, USB_CDC_DATA_LEN);
+	checkOut("bridge to the UART", ep, (const char *)data + USB_CDC_DATA_LEN, USB_CDC_DATA_LEN);
+	if (checkBridgeDrain(sent, sizeof(sent)) != 2 * USB_CDC_DATA_LEN || memcmp(sent, data, 2 * USB_CDC_DATA_LEN) != 0)
+		checkFail("bridge to the UART", "the UART did not send the host's data");
+	checkOut("bridge to the UART", ep, (const char *)data + 2 * USB_CDC_DATA_LEN, 10);
+	if (checkBridgeDrain(sent, sizeof(sent)) != 10 || memcmp(sent, data + 2 * USB_CDC_DATA_LEN, 10) != 0)
+		checkFail("bridge to the UART", "the UART did not send the host's data after its slots drained");
+
+	/* 7 data bit frames carry their parity in bit 7 */
+	++checkRuns;
+	if (usbSimRequest(0x21, USB_REQUEST_SET_LINE_CODING, 0, USB_IFACE_CDC_COMM(0), sizeof(sevenEven),
+			(void *)sevenEven) != USB_SIM_ACK)
+		checkFail("bridge parity", "SET_LINE_CODING failed");
+	checkOut("bridge parity", ep, "ac\xFF", 3);
+	if (checkBridgeDrain(sent, sizeof(sent)) != sizeof(parity) || memcmp(sent, parity, sizeof(parity)) != 0)
+		checkFail("bridge parity", "the UART did not send even parity in bit 7");
+	if (usbSimRequest(0x21, USB_REQUEST_SET_LINE_CODING, 0, USB_IFACE_CDC_COMM(0), sizeof(eightNone),
+			(void *)eightNone) != USB_SIM_ACK)
+		checkFail("bridge parity", "SET_LINE_CODING failed");
+
+	usbSimUARTReceive(data, USB_CDC_DATA_LEN + 10);
+	usbUARTBridgeIRQ();
+	++checkRuns;
+	if (PIR1bits.RC1IF)
+		checkFail("bridge from the UART", "the receive FIFO was not emptied");
+	checkPackets("bridge from the UART", ep, data, USB_CDC_DATA_LEN + 10, sizeof(rxLens), rxLens);
+	checkPackets("bridge from the UART", USB_EP_CDC_NOTIFY(0), (const uint8_t *)"", 0, 0, none);
+}
+#endif
+
+#ifdef USB_RAW_INTERFACE
+uint16_t checkRawOutLens[2];
+uint8_t checkRawOutCount;
+
+void checkRawOutDone(uint8_t *buffer, uint16_t len)
+{
+	(void)buffer;
+	if (checkRawOutCount < 2)
+		checkRawOutLens[checkRawOutCount] = len;
+	++checkRawOutCount;
+}
+
+/* The ZLP a host ends a transfer with that exactly filled the buffer for it goes with that transfer */
+void checkRawOut()
+{
+	uint8_t first[64], second[64];
+
+	checkRawOutCount = 0;
+	if (!usbRawSubmitOut(first, sizeof(first), checkRawOutDone) ||
+		!usbRawSubmitOut(second, sizeof(second), checkRawOutDone))
+		checkFail("raw OUT", "a transfer was refused");
+	checkOut("raw OUT", USB_EP_RAW, "0123456789012345678901234567890123456789012345678901234567890123", 64);
+	checkOut("raw OUT", USB_EP_RAW, "", 0);
+	checkOut("raw OUT", USB_EP_RAW, "0123456789", 10);
+	usbSimIdle(2);
+
+	++checkRuns;
+	if (checkRawOutCount != 2 || checkRawOutLens[0] != 64 || checkRawOutLens[1] != 10)
+		checkFail("raw OUT ZLP after a full buffer", "the ZLP completed the next transfer");
+	else if (memcmp(second, "0123456789", 10) != 0)
+		checkFail("raw OUT ZLP after a full buffer", "the data received was corrupted");
+}
+#endif
+
+/* Checks usbUARTReadUntil() returns the line expected, or 0 if expected is NULL */
+bool checkLine(const char *check, uint8_t *buffer, const uint16_t len, const char *expected)
+{
+	uint16_t count = usbUARTReadUntil(0, buffer, len, '\n');
+
+	++checkRuns;
+	if (expected == NULL)
+	{
+		if (count != 0)
+			return checkFail(check, "returned a line before its delimiter arrived");
+		return true;
+	}
+	if (count != strlen(expected) || memcmp(buffer, expected, count) != 0)
+	{
+		fprintf(stderr, "usbCheck: %s: returned %u bytes, expected \"%s\"\n", check, count, expected);
+		++checkFailures;
+		return false;
+	}
+	return true;
+}
+
+void checkReadUntil()
+{
+	const uint8_t ep = USB_EP_CDC_DATA(0);
+	static uint8_t ringLine[(USB_CDC_OUT_SLOTS + 2) * USB_CDC_DATA_LEN];
+	uint8_t line[128];
+	char longLine[101];
+	uint16_t count;
+
+	/* A line inside one packet, then one carried on into the next */
+	checkOut("usbUARTReadUntil", ep, "hello\nwo", 8);
+	checkLine("usbUARTReadUntil within a packet", line, sizeof(line), "hello\n");
+	checkLine("usbUARTReadUntil waiting for the rest of a line", line, sizeof(line), NULL);
+	checkOut("usbUARTReadUntil", ep, "rld\n", 4);
+	checkLine("usbUARTReadUntil across packets", line, sizeof(line), "world\n");
+
+	/* A line longer than a packet */
+	memset(longLine, 'x', sizeof(longLine) - 2);
+	longLine[sizeof(longLine) - 2] = '\n';
+	longLine[sizeof(longLine) - 1] = 0;
+	for (count = 0; count < sizeof(longLine) - 1 - USB_CDC_DATA_LEN; count += USB_CDC_DATA_LEN)
+	{
+		checkOut("usbUARTReadUntil", ep, longLine + count, USB_CDC_DATA_LEN);
+		checkLine("usbUARTReadUntil waiting for the rest of a line", line, sizeof(line), NULL);
+	}
+	checkOut("usbUARTReadUntil", ep, longLine + count, sizeof(longLine) - 1 - count);
+	checkLine("usbUARTReadUntil over a full packet", line, sizeof(line), longLine);
+
+	/* A line that does not fit the buffer stops at the buffer's length */
+	checkOut("usbUARTReadUntil", ep, "abcdefgh", 8);
+	checkLine("usbUARTReadUntil into a short buffer", line, 4, "abcd");
+	checkLine("usbUARTReadUntil with no delimiter", line, sizeof(line), NULL);
+	/* Whatever the scan copied is consumed straight away, and the line completes from the caller's buffer */
+	++checkRuns;
+	if (usbUARTHaveData(0))
+		checkFail("usbUARTReadUntil with no delimiter", "left the bytes it copied unread");
+	checkOut("usbUARTReadUntil", ep, "ij\n", 3);
+	checkLine("usbUARTReadUntil after a partial line", line, sizeof(line), "efghij\n");
+
+	/* A line longer than the whole receive ring still completes, the slots going back as it is scanned */
+	memset(line, 'y', USB_CDC_DATA_LEN);
+	for (count = 0; count <= USB_CDC_OUT_SLOTS; ++count)
+	{
+		if (!checkOut("usbUARTReadUntil over the whole ring", ep, (const char *)line, USB_CDC_DATA_LEN))
+			break;
+		checkLine("usbUARTReadUntil over the whole ring", ringLine, sizeof(ringLine), NULL);
+	}
+	checkOut("usbUARTReadUntil over the whole ring", ep, "\n", 1);
+	++checkRuns;
+	if (usbUARTReadUntil(0, ringLine, sizeof(ringLine), '\n') != (USB_CDC_OUT_SLOTS + 1) * USB_CDC_DATA_LEN + 1)
+		checkFail("usbUARTReadUntil over the whole ring", "did not return the whole line");
+}
+
+#ifdef USB_STATS
+bool checkGetStats(const char *check, const uint16_t clear, usbStats_t *stats)
+{
+	++checkRuns;
+	if (usbSimRequest(0xC0, USB_REQUEST_GET_STATS, clear, 0, sizeof(usbStats_t), stats) != USB_SIM_ACK)
+		return checkFail(check, "GET_STATS failed");
+	if (stats->version != USB_STATS_VERSION || stats->endpoints != USB_STATS_ENDPOINTS)
+		return checkFail(check, "GET_STATS returned the wrong version or endpoint count");
+	return true;
+}
+
+void checkStats()
+{
+	const uint8_t ep = USB_EP_CDC_DATA(0);
+	usbStats_t stats;
+	uint8_t data[CHECK_MAX_PACKETS * 64], lens[CHECK_MAX_PACKETS], packets;
+
+	++checkRuns;
+	if (usbSimRequest(0x40, USB_REQUEST_CLEAR_STATS, 0, 0, 0, NULL) != USB_SIM_ACK)
+		checkFail("CLEAR_STATS", "the request failed");
+
+	/* Three packets out, read back, and a write that goes out as one full packet and a ZLP */
+	checkOut("stats", ep, "0123456789", 10);
+	checkOut("stats", ep, "abc", 3);
+	usbUARTRead(0, data, sizeof(data));
+	checkOut("stats", ep, "xyz", 3);
+	usbUARTRead(0, data, sizeof(data));
+	usbUARTSendBuffer(0, data, 64);
+	packets = checkReadIn(ep, data, lens);
+
+	if (checkGetStats("GET_STATS", 0, &stats))
+	{
+		++checkRuns;
+		if (stats.ep[ep][USB_DIR_OUT].packets != 3 || stats.ep[ep][USB_DIR_OUT].bytes != 16)
+			checkFail("GET_STATS", "the OUT counters do not match the traffic");
+		if (stats.ep[ep][USB_DIR_IN].packets != packets || stats.ep[ep][USB_DIR_IN].bytes != 64)
+			checkFail("GET_STATS", "the IN counters do not match the traffic");
+		if (stats.sendHighWater[0] == 0)
+			checkFail("GET_STATS", "the send queue high water mark was not recorded");
+	}
+
+	/* Reading with wValue 1 clears the counters once the snapshot is taken */
+	if (checkGetStats("GET_STATS and clear", 1, &stats) && stats.ep[ep][USB_DIR_OUT].packets != 3)
+		checkFail("GET_STATS and clear", "the snapshot was not taken before clearing");
+	if (checkGetStats("GET_STATS after clearing", 0, &stats) &&
+		(stats.ep[ep][USB_DIR_OUT].packets != 0 || stats.ep[ep][USB_DIR_IN].packets != 0))
+		checkFail("GET_STATS after clearing", "the counters were not cleared");
+
+	/* GET_STATS is only a device to host request */
+	++checkRuns;
+	if (usbSimRequest(0x40, USB_REQUEST_GET_STATS, 0, 0, 0, NULL) != USB_SIM_STALL)
+		checkFail("GET_STATS host to device", "was not stalled");
+}
+#endif
+
+#ifdef USB_PROFILE
+uint32_t checkProfileTotal(const uint16_t bins[USB_PROFILE_BINS])
+{
+	uint32_t total = 0;
+	uint8_t i;
+	for (i = 0; i < USB_PROFILE_BINS; ++i)
+		total += bins[i];
+	return total;
+}
+
+bool checkGetProfile(const char *check, const uint16_t histogram, const uint16_t clear, uint32_t *total)
+{
+	uint16_t bins[USB_PROFILE_BINS];
+	++checkRuns;
+	if (usbSimRequest(0xC0, USB_REQUEST_GET_PROFILE, clear, histogram, sizeof(bins), bins) != USB_SIM_ACK)
+		return checkFail(check, "GET_PROFILE failed");
+	*total = checkProfileTotal(bins);
+	return true;
+}
+
+void checkProfile()
+{
+	uint16_t bins[USB_PROFILE_BINS];
+	uint32_t total;
+	uint8_t i;
+
+	/* Every histogram can be read, and the checks so far have been through every path */
+	for (i = 0; i < USB_PROFILE_HISTOGRAMS; ++i)
+	{
+#if defined(USB_POLLED) && !defined(USB_ADAPTIVE_POLL)
+		/* Which is except usbIRQ() when the SIE is only ever polled */
+		if (i == USB_PROFILE_IRQ)
+			continue;
+#endif
+		if (checkGetProfile("GET_PROFILE", i, 0, &total) && total == 0)
+		{
+			fprintf(stderr, "usbCheck: GET_PROFILE: histogram %u is empty\n", i);
+			++checkFailures;
+		}
+	}
+
+	/* wValue 1 clears just the histogram read */
+	checkGetProfile("GET_PROFILE and clear", USB_PROFILE_RESET, 1, &total);
+	if (checkGetProfile("GET_PROFILE after clearing", USB_PROFILE_RESET, 0, &total) && total != 0)
+		checkFail("GET_PROFILE after clearing", "the histogram was not cleared");
+	if (checkGetProfile("GET_PROFILE after clearing another", USB_PROFILE_SOF, 0, &total) && total == 0)
+		checkFail("GET_PROFILE after clearing another", "cleared the wrong histogram");
+
+	++checkRuns;
+	if (usbSimRequest(0x40, USB_REQUEST_CLEAR_PROFILE, 0, 0, 0, NULL) != USB_SIM_ACK)
+		checkFail("CLEAR_PROFILE", "the request failed");
+	/* Only the CLEAR_PROFILE's own SETUP can have been timed since */
+	if (checkGetProfile("GET_PROFILE after CLEAR_PROFILE", USB_PROFILE_SETUP, 0, &total) && total > 1)
+		checkFail("GET_PROFILE after CLEAR_PROFILE", "the histograms were not cleared");
+
+	++checkRuns;
+	if (usbSimRequest(0xC0, USB_REQUEST_GET_PROFILE, 0, USB_PROFILE_HISTOGRAMS, sizeof(bins), bins) != USB_SIM_STALL)
+		checkFail("GET_PROFILE of a histogram that does not exist", "was not stalled");
+	/* Nor one whose wIndex only matches an existing histogram in its low byte */
+	++checkRuns;
+	if (usbSimRequest(0xC0, USB_REQUEST_GET_PROFILE, 0, 0x0100, sizeof(bins), bins) != USB_SIM_STALL)
+		checkFail("GET_PROFILE of wIndex 0x0100", "was not stalled");
+}
+#endif
+
+#ifdef USB_DEFERRED_IRQ
+extern volatile bool usbResetPending;
+bool checkResetRaised;
+
+void checkRaiseReset(const uint8_t packet)
+{
+	(void)packet;
+	if (checkResetRaised)
+		return;
+	checkResetRaised = true;
+	UIRbits.URSTIF = 1;
+	usbSimInterrupt();
+}
+
+/* A reset arriving while usbTask() is servicing the transaction queue must keep TRNIE off until it is handled */
+void checkResetInTask()
+{
+	checkResetRaised = false;
+	usbSimServicing = checkRaiseReset;
+	checkOut("reset during usbTask()", USB_EP_CDC_DATA(0), "reset", 5);
+	usbSimServicing = NULL;
+
+	++checkRuns;
+	if (!checkResetRaised)
+		checkFail("reset during usbTask()", "the transaction was never serviced");
+	else if (usbResetPending && UIEbits.TRNIE)
+		checkFail("reset during usbTask()", "TRNIE was turned back on with the reset still to be handled");
+	/* Leave the device as the other checks expect to find it */
+	if (!usbSimEnumerate(CHECK_ADDRESS))
+		checkFail("reset during usbTask()", "the device did not enumerate again");
+}
+#endif
+
+#ifdef USB_SPLIT_IRQ
+bool checkCtrlLocked;
+
+void checkCtrlServiced(const uint8_t packet)
+{
+	usbEP_t ep;
+	ep.value = packet;
+	if (ep.epNum == 0 && !PIE3bits.USBIE)
+		checkCtrlLocked = true;
+}
+
+/* Control transactions other than SET_CONFIGURATION leave the interrupt free to service the data endpoints */
+void checkSplitLock()
+{
+	usbDeviceDescriptor_t desc;
+
+	checkCtrlLocked = false;
+	usbSimServicing = checkCtrlServiced;
+	++checkRuns;
+	if (usbSimGetDescriptor(USB_DESCRIPTOR_DEVICE, 0, sizeof(desc), &desc) != USB_SIM_ACK)
+		checkFail("split mode control transfers", "GET_DESCRIPTOR failed");
+	else if (checkCtrlLocked)
+		checkFail("split mode control transfers", "usbTask() held the interrupt off while servicing EP0");
+	usbSimServicing = NULL;
+}
+#endif
+
+int main()
+{
+	usbSimInit(NULL);
+	usbInit();
+	if (!usbCanAttach())
+		return 1;
+	usbAttach();
+	usbSimIdle(100);
+	if (!usbSimEnumerate(CHECK_ADDRESS))
+		return 1;
+
+	/* The bridged port's data interface belongs to the UART, so the application API checks on port 0 are left out */
+#ifndef USB_CDC_UART_BRIDGE
+	checkZLP();
+	checkReadUntil();
+	checkGather();
+	checkPrintf();
+#endif
+	checkClassRequests();
+	checkSerialState();
+#ifndef USB_CDC_UART_BRIDGE
+	checkDTR();
+	checkDTRKeepSegments();
+#endif
+#if USB_CDC_PORTS > 1
+	checkPorts();
+#endif
+#if CHECK_RAM_ADDR + CHECK_RAM_LEN <= USB_RAM_END && !defined(USB_CDC_UART_BRIDGE)
+	checkCoalesce();
+#endif
+#ifdef USB_CDC_UART_BRIDGE
+	checkBridge();
+	{ uint32_t t; checkGetProfile("A", 0, 0, &t); checkGetProfile("B", 0, 0, &t); }
+#endif
+#ifdef USB_RAW_INTERFACE
+	checkRawOut();
+#endif
+#if defined(USB_STATS) && !defined(USB_CDC_UART_BRIDGE)
+	checkStats();
+#endif
+#ifdef USB_PROFILE
+	checkProfile();
+#endif
+#ifdef USB_SPLIT_IRQ
+	checkSplitLock();
+#endif
+#ifdef USB_DEFERRED_IRQ
+	checkResetInTask();
+#endif
+
+	if (usbSimStats.toggleErrors != 0 || usbSimStats.overruns != 0)
+	{
+		fprintf(stderr, "usbCheck: protocol faults: %u data toggle errors, %u overruns\n",
+			usbSimStats.toggleErrors, usbSimStats.overruns);
+		++checkFailures;
+	}
+	printf("usbCheck: %u checks, %u failures\n", checkRuns, checkFailures);
+	return checkFailures != 0;
+}
@@ -0,0 +1,676 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usbSim.h"
+#include <xc.h>
+#include "usbTypes.h"
+#include "usb.h"
+#include "usbCDC.h"
+#include "usbRaw.h"
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#define USB_SIM_USTAT_FIFO_LEN	USB_USTAT_FIFO_LEN
+#define USB_SIM_SOF_OVERHEAD	6
+/* Rounds of interrupt and usbTask() the device gets after an event before it is taken to have settled */
+#define USB_SIM_DEVICE_ROUNDS	16
+
+/* The registers */
+volatile usbSimUCON_t usbSimUCONValue;
+volatile usbSimUIR_t usbSimUIRValue;
+volatile usbSimUIE_t usbSimUIE;
+volatile usbSimUEIR_t usbSimUEIR;
+volatile uint8_t usbSimUEIE, usbSimUCFG, usbSimUADDR, usbSimUSTAT;
+volatile usbSimUEP_t usbSimUEP[16];
+volatile usbSimIR3_t usbSimPIE3, usbSimPIR3, usbSimIPR3;
+volatile usbSimIR1_t usbSimPIE1, usbSimPIR1;
+volatile usbSimRCON_t usbSimRCON;
+volatile usbSimINTCON_t usbSimINTCON;
+volatile usbSimT1CON_t usbSimT1CON;
+volatile usbSimTXSTA_t usbSimTXSTA1;
+volatile usbSimRCSTA_t usbSimRCSTA1;
+volatile usbSimBAUDCON_t usbSimBAUDCON1;
+volatile uint8_t TMR1L, TMR1H, TRISA, ANSELA, TABLAT, TBLPTRL, TBLPTRH, TBLPTRU;
+volatile uint8_t SPBRG1, SPBRGH1;
+
+/* The stack's fixed address objects, declared here only to have their addresses taken */
+extern volatile usbSetupPacket_t usbEP0Setup;
+extern volatile uint8_t usbEP0Data[USB_EP0_DATA_LEN];
+extern volatile uint8_t usbCDCRAM[];
+#ifdef USB_RAW_INTERFACE
+extern volatile uint8_t usbRawIn[2][USB_RAW_DATA_LEN];
+extern volatile uint8_t usbRawOut[2][USB_RAW_DATA_LEN];
+#endif
+
+typedef struct
+{
+	volatile uint8_t *ptr;
+	uint16_t addr;
+	uint16_t len;
+} usbSimRegion_t;
+
+usbSimRegion_t usbSimRegions[7];
+uint8_t usbSimRegionCount;
+
+/* The SIE's state: the next ping-pong buffer per endpoint and direction, and the USTAT FIFO */
+uint8_t usbSimPPB[USB_ENDPOINTS][2];
+uint8_t usbSimUSTATFIFO[USB_SIM_USTAT_FIFO_LEN];
+uint8_t usbSimUSTATHead, usbSimUSTATCount;
+bool usbSimUSTATShown;
+
+/* The host's state */
+uint8_t usbSimAddress;
+bool usbSimVBus;
+uint8_t usbSimToggle[USB_ENDPOINTS][2];
+uint16_t usbSimFrameLeft;
+void (*usbSimLoop)();
+usbSimStats_t usbSimStats;
+
+/* The device's clock, and when each buffer descriptor's last transaction completed by it */
+uint64_t usbSimClock, usbSimRunStart;
+bool usbSimRunning;
+uint64_t usbSimXferDone[USB_BDT_ENTRIES];
+bool usbSimInIRQ;
+uint32_t usbSimLoopWork;
+bool usbSimProbing;
+void (*usbSimServicing)(const uint8_t packet);
+void (*usbSimSampled)(const usbSimSample_t sample, const uint64_t time);
+
+uint8_t adcGetChannel()
+{
+	return 1;
+}
+
+uint16_t adcRead()
+{
+	/* Anything from 410 up reads as VBus being present */
+	return usbSimVBus ? 512 : 0;
+}
+
+void usbSimMap(volatile void *ptr, const uint16_t addr, const uint16_t len)
+{
+	usbSimRegion_t *region = &usbSimRegions[usbSimRegionCount++];
+	region->ptr = ptr;
+	region->addr = addr;
+	region->len = len;
+}
+
+void *usbSimAddrToPtr(const uint16_t addr)
+{
+	uint8_t i;
+	for (i = 0; i < usbSimRegionCount; ++i)
+	{
+		if (addr >= usbSimRegions[i].addr && addr < usbSimRegions[i].addr + usbSimRegions[i].len)
+			return (void *)(usbSimRegions[i].ptr + (addr - usbSimRegions[i].addr));
+	}
+	fprintf(stderr, "usbSim: access to unmapped address 0x%03X\n", addr);
+	abort();
+}
+
+uint16_t usbSimPtrToAddr(const volatile void *ptr)
+{
+	const volatile uint8_t *p = ptr;
+	uint8_t i;
+	for (i = 0; i < usbSimRegionCount; ++i)
+	{
+		if (p >= usbSimRegions[i].ptr && p < usbSimRegions[i].ptr + usbSimRegions[i].len)
+			return usbSimRegions[i].addr + (p - usbSimRegions[i].ptr);
+	}
+	/* Not in the SIE's view, and so not USB RAM */
+	return 0xFFFF;
+}
+
+/*
+ * Clearing TRNIF pops the USTAT FIFO, and the next entry, if any, is shown straight away.
+ */
+void usbSimUpdateUSTAT()
+{
+	if (usbSimUSTATShown && !usbSimUIRValue.TRNIF)
+	{
+		usbSimUSTATHead = (usbSimUSTATHead + 1) & (USB_SIM_USTAT_FIFO_LEN - 1);
+		--usbSimUSTATCount;
+		usbSimUSTATShown = false;
+	}
+	if (!usbSimUSTATShown && usbSimUSTATCount != 0)
+	{
+		usbSimUSTAT = usbSimUSTATFIFO[usbSimUSTATHead];
+		usbSimUIRValue.TRNIF = 1;
+		usbSimUSTATShown = true;
+	}
+}
+
+volatile usbSimUIR_t *usbSimUIR()
+{
+	usbSimUpdateUSTAT();
+	return &usbSimUIRValue;
+}
+
+volatile usbSimUCON_t *usbSimUCON()
+{
+	/* PPBRST holds every endpoint's ping-pong pointers on the even buffer */
+	if (usbSimUCONValue.PPBRST)
+		memset(usbSimPPB, 0, sizeof(usbSimPPB));
+	return &usbSimUCONValue;
+}
+
+/* EUSART1's receive FIFO and transmit buffer */
+uint8_t usbSimUARTRx[USB_SIM_UART_FIFO_LEN];
+uint16_t usbSimUARTRxHead, usbSimUARTRxCount;
+volatile uint8_t usbSimUARTTx;
+
+/*
+ * Reading RCREG1 pops the receive FIFO, and RC1IF stays set for as long as there is more to read.
+ */
+uint8_t usbSimRCREG1()
+{
+	uint8_t data;
+	if (usbSimUARTRxCount == 0)
+		return 0;
+	data = usbSimUARTRx[usbSimUARTRxHead];
+	usbSimUARTRxHead = (usbSimUARTRxHead + 1) % USB_SIM_UART_FIFO_LEN;
+	--usbSimUARTRxCount;
+	usbSimPIR1.RC1IF = usbSimUARTRxCount != 0;
+	return data;
+}
+
+/*
+ * The stack only ever writes TXREG1, which fills the transmit buffer and so clears TX1IF until usbSimUARTShift() empties it.
+ */
+volatile uint8_t *usbSimTXREG1()
+{
+	usbSimPIR1.TX1IF = 0;
+	return &usbSimUARTTx;
+}
+
+void usbSimUARTReceive(const uint8_t *data, const uint16_t len)
+{
+	uint16_t i;
+	for (i = 0; i < len && usbSimUARTRxCount != USB_SIM_UART_FIFO_LEN; ++i, ++usbSimUARTRxCount)
+		usbSimUARTRx[(usbSimUARTRxHead + usbSimUARTRxCount) % USB_SIM_UART_FIFO_LEN] = data[i];
+	usbSimPIR1.RC1IF = usbSimUARTRxCount != 0;
+}
+
+bool usbSimUARTShift(uint8_t *data)
+{
+	if (usbSimPIR1.TX1IF)
+		return false;
+	*data = usbSimUARTTx;
+	usbSimPIR1.TX1IF = 1;
+	return true;
+}
+
+bool usbSimIRQPending()
+{
+	usbSimUpdateUSTAT();
+	if ((usbSimUIRValue.value & usbSimUIE.value) == 0)
+		return false;
+	usbSimPIR3.USBIF = 1;
+	return true;
+}
+
+uint64_t usbSimNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000U + now.tv_nsec;
+}
+
+uint64_t usbSimDeviceClock()
+{
+	if (usbSimRunning)
+		return usbSimClock + usbSimNow() - usbSimRunStart;
+	return usbSimClock;
+}
+
+void usbSimServiced(const uint8_t packet)
+{
+	uint64_t wait;
+	if (usbSimProbing)
+	{
+		wait = usbSimDeviceClock() - usbSimXferDone[packet];
+		if (wait > usbSimStats.maxWait)
+			usbSimStats.maxWait = wait;
+		if (usbSimSampled != NULL)
+			usbSimSampled(USB_SIM_SAMPLE_WAIT, wait);
+	}
+	if (usbSimServicing != NULL)
+		usbSimServicing(packet);
+}
+
+void usbSimInterrupt()
+{
+	uint64_t start, time;
+	if (usbSimInIRQ)
+		return;
+	usbSimInIRQ = true;
+	/* Take the interrupt for as long as it is enabled and there is something pending, as the CPU would */
+	while (usbSimPIE3.USBIE && usbSimIRQPending())
+	{
+		usbSimPIR3.USBIF = 0;
+		++usbSimStats.interrupts;
+		if (!usbSimProbing)
+		{
+			usbIRQ();
+			continue;
+		}
+		start = usbSimNow();
+		usbIRQ();
+		time = usbSimNow() - start;
+		if (time > usbSimStats.maxIRQTime)
+			usbSimStats.maxIRQTime = time;
+		if (usbSimSampled != NULL)
+			usbSimSampled(USB_SIM_SAMPLE_IRQ, time);
+	}
+	usbSimInIRQ = false;
+}
+
+void usbSimRunDevice()
+{
+	uint64_t time;
+	uint8_t round;
+
+	usbSimRunStart = usbSimNow();
+	usbSimRunning = true;
+	for (round = 0; round < USB_SIM_DEVICE_ROUNDS; ++round)
+	{
+		usbSimInterrupt();
+		/* The main loop gets round to usbTask() once it is done with the application's work */
+		if (round == 0)
+			usbSimClock += usbSimLoopWork;
+		usbTask();
+		if (!usbSimIRQPending())
+			break;
+	}
+	usbSimRunning = false;
+	time = usbSimNow() - usbSimRunStart;
+	usbSimClock += time;
+	usbSimStats.deviceTime += time;
+
+	if (usbSimLoop != NULL)
+		usbSimLoop();
+}
+
+void usbSimInit(void (*loop)())
+{
+	usbSimRegionCount = 0;
+	usbSimMap(usbBDT, USB_BDT_ADDR, sizeof(usbBDTEntry_t) * USB_BDT_ENTRIES);
+	usbSimMap(&usbEP0Setup, USB_EP0_SETUP_ADDR, USB_EP0_SETUP_LEN);
+	usbSimMap(usbEP0Data, USB_EP0_DATA_ADDR, USB_EP0_DATA_LEN);
+	usbSimMap(usbCDCRAM, USB_CDC_RAM_ADDR, USB_CDC_RAM_END - USB_CDC_RAM_ADDR);
+#ifdef USB_RAW_INTERFACE
+	usbSimMap(usbRawIn, USB_RAW_IN_ADDR, sizeof(usbRawIn));
+	usbSimMap(usbRawOut, USB_RAW_OUT_ADDR, sizeof(usbRawOut));
+#endif
+
+	memset(usbSimPPB, 0, sizeof(usbSimPPB));
+	memset(usbSimToggle, 0, sizeof(usbSimToggle));
+	memset(&usbSimStats, 0, sizeof(usbSimStats));
+	usbSimUSTATHead = 0;
+	usbSimUSTATCount = 0;
+	usbSimUSTATShown = false;
+	usbSimUARTRxHead = 0;
+	usbSimUARTRxCount = 0;
+	/* The transmit buffer starts out empty */
+	usbSimPIR1.TX1IF = 1;
+	usbSimPIR1.RC1IF = 0;
+	usbSimAddress = 0;
+	usbSimFrameLeft = 0;
+	usbSimLoop = loop;
+	usbSimServicing = NULL;
+	usbSimSampled = NULL;
+	usbSimProbing = true;
+	usbSimVBus = true;
+}
+
+void usbSimFrame()
+{
+	++usbSimStats.frames;
+	usbSimFrameLeft = USB_SIM_FRAME_BYTES - USB_SIM_SOF_OVERHEAD;
+	if (usbSimUCONValue.USBEN)
+		usbSimUIRValue.SOFIF = 1;
+	usbSimRunDevice();
+}
+
+void usbSimIdle(const uint32_t frames)
+{
+	uint32_t i;
+	for (i = 0; i < frames; ++i)
+		usbSimFrame();
+}
+
+void usbSimBusReset()
+{
+	/* No SOFs go out while the bus is held in reset */
+	usbSimStats.frames += 10;
+	usbSimFrameLeft = 0;
+	usbSimUADDR = 0;
+	usbSimAddress = 0;
+	memset(usbSimToggle, 0, sizeof(usbSimToggle));
+	usbSimUIRValue.URSTIF = 1;
+	usbSimRunDevice();
+	usbSimIdle(10);
+}
+
+void usbSimResetToggles()
+{
+	uint8_t ep;
+	for (ep = 1; ep < USB_ENDPOINTS; ++ep)
+	{
+		usbSimToggle[ep][USB_DIR_OUT] = 0;
+		usbSimToggle[ep][USB_DIR_IN] = 0;
+	}
+}
+
+/* Makes sure the frame has room for a transaction of up to len bytes, starting the next one if not */
+void usbSimReserve(const uint8_t len)
+{
+	if (usbSimFrameLeft < USB_SIM_XFER_OVERHEAD + len)
+		usbSimFrame();
+}
+
+/*
+ * Processes one token addressed to the device the way the SIE does,
+ * moving the data to or from the buffer descriptor's buffer.
+ */
+usbSimResult_t usbSimTransaction(const uint8_t pid, const uint8_t ep, uint8_t *data, uint8_t *len)
+{
+	const uint8_t dir = pid == USB_PID_IN ? USB_DIR_IN : USB_DIR_OUT;
+	const uint8_t uep = usbSimUEP[ep].value;
+	const uint8_t ppb = usbSimUCFG & 0x03;
+	/* UCFG's PPB bits say which endpoints have ping-pong buffering */
+	const bool pingPong = ppb == 2 || (ppb == 1 && ep == 0 && dir == USB_DIR_OUT) || (ppb == 3 && ep != 0);
+	volatile usbBDTEntry_t *bd;
+	uint8_t buff = 0;
+	uint16_t capacity;
+
+	if (!usbSimUCONValue.USBEN || ep >= USB_ENDPOINTS || usbSimUADDR != usbSimAddress)
+		return USB_SIM_TIMEOUT;
+	if (!(uep & (dir == USB_DIR_IN ? USB_UEP_INEN : USB_UEP_OUTEN)) ||
+		(pid == USB_PID_SETUP && (uep & USB_UEP_CONDIS)))
+		return USB_SIM_TIMEOUT;
+	if (usbSimUSTATCount == USB_SIM_USTAT_FIFO_LEN || usbSimUCONValue.PKTDIS)
+		return USB_SIM_NAK;
+
+	if (pingPong)
+		buff = usbSimPPB[ep][dir];
+	bd = &usbBDT[(ep << 2) | (dir << 1) | buff];
+
+	if (pid != USB_PID_SETUP && (uep & USB_UEP_STALL))
+	{
+		usbSimUIRValue.STALLIF = 1;
+		return USB_SIM_STALL;
+	}
+	if (!bd->status.usbOwned)
+		return USB_SIM_NAK;
+	if (pid != USB_PID_SETUP && bd->status.bufferStall)
+	{
+		usbSimUIRValue.STALLIF = 1;
+		return USB_SIM_STALL;
+	}
+
+	capacity = bd->count | (bd->status.countH << 8);
+	if (dir == USB_DIR_OUT)
+	{
+		if (pid == USB_PID_OUT && bd->status.dataToggleSyncEn &&
+			bd->status.dataToggleSync != usbSimToggle[ep][USB_DIR_OUT])
+		{
+			/* The SIE ACKs a packet with the wrong toggle, taken as a retry, but drops it */
+			++usbSimStats.toggleErrors;
+			return USB_SIM_ACK;
+		}
+		if (*len > capacity)
+		{
+			++usbSimStats.overruns;
+			*len = capacity;
+		}
+		if (*len != 0)
+			memcpy(addrToPtr(bd->address), data, *len);
+		bd->count = *len;
+		if (pid == USB_PID_SETUP)
+			usbSimUCONValue.PKTDIS = 1;
+	}
+	else
+	{
+		*len = capacity;
+		if (capacity != 0)
+			memcpy(data, addrToPtr(bd->address), capacity);
+		if (bd->status.dataToggleSync != usbSimToggle[ep][USB_DIR_IN])
+		{
+			/* The host ACKs a packet with the wrong toggle but throws it away */
+			++usbSimStats.toggleErrors;
+			*len = 0;
+			usbSimToggle[ep][USB_DIR_IN] ^= 1;
+		}
+	}
+	/* Hand the descriptor back with the token's PID, the SIE leaving bit 6 be */
+	bd->status.value = (bd->status.value & 0x40) | (pid << 2);
+
+	usbSimUSTATFIFO[(usbSimUSTATHead + usbSimUSTATCount) & (USB_SIM_USTAT_FIFO_LEN - 1)] =
+		(ep << 3) | (dir << 2) | (buff << 1);
+	++usbSimUSTATCount;
+	usbSimXferDone[(ep << 2) | (dir << 1) | buff] = usbSimClock;
+	usbSimUpdateUSTAT();
+	if (pingPong)
+		usbSimPPB[ep][dir] ^= 1;
+	usbSimToggle[ep][dir] ^= 1;
+	return USB_SIM_ACK;
+}
+
+/* Accounts for a transaction's bus time and outcome, then lets the device respond to it */
+usbSimResult_t usbSimComplete(const usbSimResult_t result, const uint8_t dir, const uint8_t len)
+{
+	if (result == USB_SIM_ACK)
+	{
+		usbSimFrameLeft -= USB_SIM_XFER_OVERHEAD + len;
+		++usbSimStats.transactions;
+		if (dir == USB_DIR_IN)
+			usbSimStats.bytesIn += len;
+		else
+			usbSimStats.bytesOut += len;
+	}
+	else
+	{
+		usbSimFrameLeft -= USB_SIM_NAK_OVERHEAD;
+		if (result == USB_SIM_NAK)
+			++usbSimStats.naks;
+		else if (result == USB_SIM_STALL)
+			++usbSimStats.stalls;
+	}
+	usbSimRunDevice();
+	return result;
+}
+
+/* data must have room for a full-size packet */
+usbSimResult_t usbSimIn(const uint8_t ep, uint8_t *data, uint8_t *len)
+{
+	usbSimResult_t result;
+	usbSimReserve(ep == 0 ? USB_SIM_EP0_LEN : 64);
+	*len = 0;
+	result = usbSimTransaction(USB_PID_IN, ep, data, len);
+	return usbSimComplete(result, USB_DIR_IN, *len);
+}
+
+usbSimResult_t usbSimOut(const uint8_t ep, const uint8_t *data, const uint8_t len)
+{
+	usbSimResult_t result;
+	uint8_t count = len;
+	usbSimReserve(len);
+	result = usbSimTransaction(USB_PID_OUT, ep, (uint8_t *)data, &count);
+	return usbSimComplete(result, USB_DIR_OUT, count);
+}
+
+usbSimResult_t usbSimSetupStage(const usbSimSetup_t *setup)
+{
+	uint8_t packet[8], len = 8;
+	usbSimResult_t result;
+
+	packet[0] = setup->requestType;
+	packet[1] = setup->request;
+	packet[2] = setup->value;
+	packet[3] = setup->value >> 8;
+	packet[4] = setup->index;
+	packet[5] = setup->index >> 8;
+	packet[6] = setup->length;
+	packet[7] = setup->length >> 8;
+
+	usbSimReserve(len);
+	/* SETUP is always DATA0, and what follows it DATA1 */
+	usbSimToggle[0][USB_DIR_OUT] = 0;
+	result = usbSimTransaction(USB_PID_SETUP, 0, packet, &len);
+	if (result == USB_SIM_ACK)
+	{
+		usbSimToggle[0][USB_DIR_OUT] = 1;
+		usbSimToggle[0][USB_DIR_IN] = 1;
+	}
+	return usbSimComplete(result, USB_DIR_OUT, len);
+}
+
+usbSimResult_t usbSimControl(const usbSimSetup_t *setup, uint8_t *data, uint16_t *actual)
+{
+	const uint32_t deadline = usbSimStats.frames + USB_SIM_CTRL_TIMEOUT;
+	const bool in = (setup->requestType & 0x80) != 0;
+	uint8_t packet[64], len;
+	uint16_t done = 0;
+	usbSimResult_t result;
+
+	*actual = 0;
+	while ((result = usbSimSetupStage(setup)) == USB_SIM_NAK)
+	{
+		if (usbSimStats.frames >= deadline)
+			return USB_SIM_TIMEOUT;
+	}
+	if (result != USB_SIM_ACK)
+		return result;
+
+	while (done < setup->length)
+	{
+		if (in)
+		{
+			result = usbSimIn(0, packet, &len);
+			if (result == USB_SIM_ACK)
+			{
+				if (len > setup->length - done)
+					len = setup->length - done;
+				memcpy(data + done, packet, len);
+				done += len;
+				/* A short packet ends the data stage early */
+				if (len < USB_SIM_EP0_LEN)
+					break;
+			}
+		}
+		else
+		{
+			len = setup->length - done < USB_SIM_EP0_LEN ? setup->length - done : USB_SIM_EP0_LEN;
+			result = usbSimOut(0, data + done, len);
+			if (result == USB_SIM_ACK)
+				done += len;
+		}
+		if (result == USB_SIM_NAK && usbSimStats.frames >= deadline)
+			return USB_SIM_TIMEOUT;
+		else if (result == USB_SIM_STALL || result == USB_SIM_TIMEOUT)
+			return result;
+	}
+	*actual = done;
+
+	/* The status stage is a ZLP the other way, always DATA1 */
+	usbSimToggle[0][in ? USB_DIR_OUT : USB_DIR_IN] = 1;
+	do
+	{
+		if (in)
+			result = usbSimOut(0, NULL, 0);
+		else
+			result = usbSimIn(0, packet, &len);
+		if (result == USB_SIM_NAK && usbSimStats.frames >= deadline)
+			return USB_SIM_TIMEOUT;
+	}
+	while (result == USB_SIM_NAK);
+	return result;
+}
+
+bool usbSimFailed(const char *what)
+{
+	fprintf(stderr, "usbSim: enumeration failed at %s\n", what);
+	return false;
+}
+
+usbSimResult_t usbSimRequest(const uint8_t requestType, const uint8_t request, const uint16_t value,
+	const uint16_t index, const uint16_t length, void *data)
+{
+	const usbSimSetup_t setup = { requestType, request, value, index, length };
+	uint16_t actual;
+	return usbSimControl(&setup, data, &actual);
+}
+
+usbSimResult_t usbSimGetDescriptor(const uint8_t type, const uint8_t index, const uint16_t length, void *data)
+{
+	return usbSimRequest(0x80, USB_REQUEST_GET_DESCRIPTOR, (type << 8) | index,
+		type == USB_DESCRIPTOR_STRING && index != 0 ? 0x0409 : 0, length, data);
+}
+
+bool usbSimEnumerate(const uint8_t address)
+{
+	uint8_t data[256];
+	uint16_t configLen;
+	uint8_t i, manufacturer, product;
+	const uint8_t lineCoding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };
+
+	usbSimBusReset();
+	if (usbSimGetDescriptor(USB_DESCRIPTOR_DEVICE, 0, 64, data) != USB_SIM_ACK ||
+		usbSimRequest(0x00, USB_REQUEST_SET_ADDRESS, address, 0, 0, NULL) != USB_SIM_ACK)
+		return usbSimFailed("SET_ADDRESS");
+	/* The address takes effect once the status stage is done, after which the device gets 2ms to settle */
+	usbSimAddress = address;
+	usbSimIdle(2);
+
+	if (usbSimGetDescriptor(USB_DESCRIPTOR_DEVICE, 0, 18, data) != USB_SIM_ACK)
+		return usbSimFailed("device descriptor");
+	manufacturer = data[14];
+	product = data[15];
+	if (usbSimGetDescriptor(USB_DESCRIPTOR_CONFIGURATION, 0, 9, data) != USB_SIM_ACK)
+		return usbSimFailed("configuration descriptor");
+	configLen = data[2] | (data[3] << 8);
+	if (configLen > sizeof(data) ||
+		usbSimGetDescriptor(USB_DESCRIPTOR_CONFIGURATION, 0, configLen, data) != USB_SIM_ACK)
+		return usbSimFailed("configuration descriptor set");
+	if (usbSimGetDescriptor(USB_DESCRIPTOR_STRING, 0, 255, data) != USB_SIM_ACK ||
+		(manufacturer != 0 && usbSimGetDescriptor(USB_DESCRIPTOR_STRING, manufacturer, 255, data) != USB_SIM_ACK) ||
+		(product != 0 && usbSimGetDescriptor(USB_DESCRIPTOR_STRING, product, 255, data) != USB_SIM_ACK))
+		return usbSimFailed("string descriptors");
+	if (usbSimRequest(0x00, USB_REQUEST_SET_CONFIGURATION, 1, 0, 0, NULL) != USB_SIM_ACK)
+		return usbSimFailed("SET_CONFIGURATION");
+	usbSimResetToggles();
+
+	/* Open every port at 115200 8N1 with DTR and RTS raised */
+	for (i = 0; i < USB_CDC_PORTS; ++i)
+	{
+		if (usbSimRequest(0x21, USB_REQUEST_SET_LINE_CODING, 0, USB_IFACE_CDC_COMM(i),
+				sizeof(lineCoding), (void *)lineCoding) != USB_SIM_ACK ||
+			usbSimRequest(0x21, USB_REQUEST_SET_CONTROL_LINE, 0x03, USB_IFACE_CDC_COMM(i), 0, NULL) != USB_SIM_ACK)
+			return usbSimFailed("opening the CDC ports");
+	}
+	return true;
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBSIM_H
+#define	USBSIM_H
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The emulated SIE works the buffer descriptor table the way the PIC18's does, with ping-pong
+ * buffers, data toggle checking, PKTDIS on SETUP and a four deep USTAT FIFO. The emulated
+ * full-speed host drives it a transaction at a time. Each frame starts with a SOF and gives
+ * USB_SIM_FRAME_BYTES of bus time, which every transaction spends in data plus protocol overhead.
+ * That allows the 19 full-size bulk packets a frame that a real full-speed bus does.
+ *
+ * After every bus event the device gets to run: usbIRQ() for as long as the interrupt is enabled
+ * and pending, then usbTask(), then the application's loop body. The time spent in usbIRQ() and
+ * usbTask() is the device CPU time that usbSimStats counts.
+ *
+ * The device also has a clock of its own, which runs while usbIRQ() or usbTask() do, and with
+ * which the SIE stamps each transaction as it completes. How long that is before the transaction
+ * starts being serviced is its wait, the worst of which usbSimStats also keeps, along with the longest
+ * any one usbIRQ() took. Measuring those reads the host's clock inside the device code, which takes
+ * time of its own, so they are only measured while usbSimProbing is set, as it is to start with.
+ * The application's own work is modelled by usbSimLoopWork, the nanoseconds each pass of the main
+ * loop spends on something other than USB: a bus event is taken to arrive just as that starts,
+ * so the interrupt gets to it straight away but usbTask() only once the clock has run on by usbSimLoopWork.
+ */
+#define USB_SIM_FRAME_BYTES		1500
+/* Bytes of bus time a transaction costs beyond its data: token, PIDs, CRC, handshake and gaps */
+#define USB_SIM_XFER_OVERHEAD	13
+/* A NAKed or STALLed transaction carries no data packet */
+#define USB_SIM_NAK_OVERHEAD	10
+
+#define USB_SIM_EP0_LEN			8
+/* How many frames a control transfer may take before the host gives up on it, as USB allows 5s */
+#define USB_SIM_CTRL_TIMEOUT	5000
+#define USB_SIM_UART_FIFO_LEN	256
+
+typedef enum
+{
+	USB_SIM_ACK,
+	USB_SIM_NAK,
+	USB_SIM_STALL,
+	USB_SIM_TIMEOUT
+} usbSimResult_t;
+
+typedef struct
+{
+	uint8_t requestType;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+} usbSimSetup_t;
+
+typedef struct
+{
+	/* Frames the host has started */
+	uint32_t frames;
+	/* Transactions that moved data, and all those that were NAKed */
+	uint32_t transactions;
+	uint32_t naks;
+	uint32_t stalls;
+	/* Data payload bytes moved each way */
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	/* Nanoseconds spent in usbIRQ() and usbTask() */
+	uint64_t deviceTime;
+	/* The longest any transaction waited to be serviced, in nanoseconds of device time */
+	uint64_t maxWait;
+	/* Times usbIRQ() was taken, and the longest it took any one time in nanoseconds */
+	uint32_t interrupts;
+	uint64_t maxIRQTime;
+	/* Protocol faults: mismatched data toggles and packets larger than the buffer armed for them */
+	uint32_t toggleErrors;
+	uint32_t overruns;
+} usbSimStats_t;
+
+/* The host's monotonic clock, in nanoseconds */
+extern uint64_t usbSimNow();
+/* Sets up the SIE and its view of USB RAM. loop is the application's main loop body, which may be NULL */
+extern void usbSimInit(void (*loop)());
+/* Puts len bytes at ptr in the SIE's view of USB RAM at addr, after usbSimInit(), for an application's own buffers */
+extern void usbSimMap(volatile void *ptr, const uint16_t addr, const uint16_t len);
+/* Runs the device once, as after any bus event */
+extern void usbSimRunDevice();
+/*
+ * Takes the USB interrupt there and then if it is enabled and pending and not already being taken,
+ * as the CPU would wherever the device code has got to. usbSimServicing, if set, is called as each
+ * transaction starts being serviced, and can use this to have an interrupt arrive at that point.
+ */
+extern void usbSimInterrupt();
+extern void (*usbSimServicing)(const uint8_t packet);
+
+typedef enum
+{
+	USB_SIM_SAMPLE_WAIT,
+	USB_SIM_SAMPLE_IRQ,
+	USB_SIM_SAMPLES
+} usbSimSample_t;
+
+/* If set, is given every transaction's wait and every usbIRQ()'s time as it is measured */
+extern void (*usbSimSampled)(const usbSimSample_t sample, const uint64_t time);
+/* Starts the next frame, sending a SOF */
+extern void usbSimFrame();
+/* Lets the given number of frames go by with only SOFs on the bus */
+extern void usbSimIdle(const uint32_t frames);
+/* Holds the bus in reset for 10ms, then gives the device the 10ms of recovery time USB requires */
+extern void usbSimBusReset();
+
+extern usbSimResult_t usbSimIn(const uint8_t ep, uint8_t *data, uint8_t *len);
+extern usbSimResult_t usbSimOut(const uint8_t ep, const uint8_t *data, const uint8_t len);
+/*
+ * Runs a whole control transfer on EP0, retrying NAKed stages in later frames. data holds
+ * the data stage, and actual is set to how much of it was moved. Returns USB_SIM_ACK on success.
+ */
+extern usbSimResult_t usbSimControl(const usbSimSetup_t *setup, uint8_t *data, uint16_t *actual);
+/* Resets the host's data toggles for every endpoint but EP0, as setting a configuration does */
+extern void usbSimResetToggles();
+/* Runs a control transfer with the given SETUP fields, data being the data stage's buffer */
+extern usbSimResult_t usbSimRequest(const uint8_t requestType, const uint8_t request, const uint16_t value,
+	const uint16_t index, const uint16_t length, void *data);
+extern usbSimResult_t usbSimGetDescriptor(const uint8_t type, const uint8_t index, const uint16_t length, void *data);
+/*
+ * Resets and enumerates the device as a host would, giving it address, then opens every CDC port
+ * at 115200 8N1 with DTR and RTS raised. Says what failed on stderr and returns false if anything does.
+ */
+extern bool usbSimEnumerate(const uint8_t address);
+
+/*
+ * EUSART1's side of the line, for the UART bridge. usbSimUARTReceive() puts bytes on the line for the EUSART
+ * to receive, setting RC1IF. Its receive FIFO holds USB_SIM_UART_FIFO_LEN bytes rather than the hardware's two,
+ * so the caller need not take the interrupt after every byte. usbSimUARTShift() sends the byte written to TXREG1,
+ * if there is one, returning it in data and setting TX1IF again; it returns false if TXREG1 was empty.
+ * Nothing runs usbUARTBridgeIRQ() for the caller, who has to call it as the interrupt would be taken.
+ */
+extern void usbSimUARTReceive(const uint8_t *data, const uint16_t len);
+extern bool usbSimUARTShift(uint8_t *data);
+
+extern uint32_t usbSimLoopWork;
+extern bool usbSimProbing;
+extern uint8_t usbSimAddress;
+extern bool usbSimVBus;
+extern usbSimStats_t usbSimStats;
+
+#endif	/* USBSIM_H */
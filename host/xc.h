@@ -0,0 +1,305 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XC_H
+#define	XC_H
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+/*
+ * Stands in for XC8's xc.h when the stack is built for the host against the emulated SIE in usbSim.c.
+ * The registers the stack uses are modelled with the PIC18F45K50's bit layouts. UCON and UIR go
+ * through accessors so the SIE sees what the stack wrote to them on its next access, which is how
+ * PPBRST pulses and clearing TRNIF to pop the USTAT FIFO are modelled. RCREG1 and TXREG1 go through
+ * accessors too, so reading RCREG1 pops the EUSART's receive FIFO and writing TXREG1 fills its
+ * transmit buffer, as usbSimUARTReceive() and usbSimUARTShift() describe. Everything else is plain memory.
+ *
+ * Any file including this must include its system headers first: XC8 never pads structures,
+ * so neither may the host build, and the packing applies to everything that follows.
+ */
+
+#include <stdint.h>
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t : 1;
+		uint8_t SUSPND : 1;
+		uint8_t RESUME : 1;
+		uint8_t USBEN : 1;
+		uint8_t PKTDIS : 1;
+		uint8_t SE0 : 1;
+		uint8_t PPBRST : 1;
+		uint8_t : 1;
+	};
+} usbSimUCON_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t URSTIF : 1;
+		uint8_t UERRIF : 1;
+		uint8_t ACTVIF : 1;
+		uint8_t TRNIF : 1;
+		uint8_t IDLEIF : 1;
+		uint8_t STALLIF : 1;
+		uint8_t SOFIF : 1;
+		uint8_t : 1;
+	};
+} usbSimUIR_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t URSTIE : 1;
+		uint8_t UERRIE : 1;
+		uint8_t ACTVIE : 1;
+		uint8_t TRNIE : 1;
+		uint8_t IDLEIE : 1;
+		uint8_t STALLIE : 1;
+		uint8_t SOFIE : 1;
+		uint8_t : 1;
+	};
+} usbSimUIE_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t PIDEF : 1;
+		uint8_t CRC5EF : 1;
+		uint8_t CRC16EF : 1;
+		uint8_t DFN8EF : 1;
+		uint8_t BTOEF : 1;
+		uint8_t : 2;
+		uint8_t BTSEF : 1;
+	};
+} usbSimUEIR_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t EPSTALL : 1;
+		uint8_t EPINEN : 1;
+		uint8_t EPOUTEN : 1;
+		uint8_t EPCONDIS : 1;
+		uint8_t EPHSHK : 1;
+		uint8_t : 3;
+	};
+} usbSimUEP_t;
+
+/* Only the bits of the interrupt and core registers that the stack touches */
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t : 2;
+		uint8_t USBIE : 1;
+		uint8_t : 5;
+	};
+	struct
+	{
+		uint8_t : 2;
+		uint8_t USBIF : 1;
+		uint8_t : 5;
+	};
+	struct
+	{
+		uint8_t : 2;
+		uint8_t USBIP : 1;
+		uint8_t : 5;
+	};
+} usbSimIR3_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t : 4;
+		uint8_t TX1IE : 1;
+		uint8_t RC1IE : 1;
+		uint8_t : 2;
+	};
+	struct
+	{
+		uint8_t : 4;
+		uint8_t TX1IF : 1;
+		uint8_t RC1IF : 1;
+		uint8_t : 2;
+	};
+} usbSimIR1_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t : 7;
+		uint8_t IPEN : 1;
+	};
+} usbSimRCON_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t : 6;
+		uint8_t GIEL : 1;
+		uint8_t GIEH : 1;
+	};
+} usbSimINTCON_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t TMR1ON : 1;
+		uint8_t RD16 : 1;
+		uint8_t : 6;
+	};
+} usbSimT1CON_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t TX9D : 1;
+		uint8_t TRMT : 1;
+		uint8_t BRGH : 1;
+		uint8_t SENDB : 1;
+		uint8_t SYNC : 1;
+		uint8_t TXEN : 1;
+		uint8_t TX9 : 1;
+		uint8_t CSRC : 1;
+	};
+} usbSimTXSTA_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t RX9D : 1;
+		uint8_t OERR : 1;
+		uint8_t FERR : 1;
+		uint8_t ADDEN : 1;
+		uint8_t CREN : 1;
+		uint8_t SREN : 1;
+		uint8_t RX9 : 1;
+		uint8_t SPEN : 1;
+	};
+} usbSimRCSTA_t;
+
+typedef union
+{
+	uint8_t value;
+	struct
+	{
+		uint8_t ABDEN : 1;
+		uint8_t WUE : 1;
+		uint8_t : 1;
+		uint8_t BRG16 : 1;
+		uint8_t CKTXP : 1;
+		uint8_t DTRXP : 1;
+		uint8_t RCIDL : 1;
+		uint8_t ABDOVF : 1;
+	};
+} usbSimBAUDCON_t;
+
+extern volatile usbSimUCON_t *usbSimUCON();
+extern volatile usbSimUIR_t *usbSimUIR();
+extern volatile usbSimUIE_t usbSimUIE;
+extern volatile usbSimUEIR_t usbSimUEIR;
+extern volatile uint8_t usbSimUEIE, usbSimUCFG, usbSimUADDR, usbSimUSTAT;
+extern volatile usbSimUEP_t usbSimUEP[16];
+extern volatile usbSimIR3_t usbSimPIE3, usbSimPIR3, usbSimIPR3;
+extern volatile usbSimIR1_t usbSimPIE1, usbSimPIR1;
+extern volatile usbSimRCON_t usbSimRCON;
+extern volatile usbSimINTCON_t usbSimINTCON;
+extern volatile usbSimT1CON_t usbSimT1CON;
+extern volatile usbSimTXSTA_t usbSimTXSTA1;
+extern volatile usbSimRCSTA_t usbSimRCSTA1;
+extern volatile usbSimBAUDCON_t usbSimBAUDCON1;
+extern volatile uint8_t TMR1L, TMR1H, TRISA, ANSELA, TABLAT, TBLPTRL, TBLPTRH, TBLPTRU;
+extern volatile uint8_t SPBRG1, SPBRGH1;
+extern uint8_t usbSimRCREG1();
+extern volatile uint8_t *usbSimTXREG1();
+
+#define UCON		(usbSimUCON()->value)
+#define UCONbits	(*usbSimUCON())
+#define UIR			(usbSimUIR()->value)
+#define UIRbits		(*usbSimUIR())
+#define UIE			(usbSimUIE.value)
+#define UIEbits		usbSimUIE
+#define UEIR		(usbSimUEIR.value)
+#define UEIRbits	usbSimUEIR
+#define UEIE		usbSimUEIE
+#define UCFG		usbSimUCFG
+#define UADDR		usbSimUADDR
+#define USTAT		usbSimUSTAT
+#define UEP0		(usbSimUEP[0].value)
+#define UEP0bits	usbSimUEP[0]
+#define PIE3bits	usbSimPIE3
+#define PIR3bits	usbSimPIR3
+#define IPR3bits	usbSimIPR3
+#define PIE1bits	usbSimPIE1
+#define PIR1bits	usbSimPIR1
+#define RCONbits	usbSimRCON
+#define INTCONbits	usbSimINTCON
+#define T1CON		(usbSimT1CON.value)
+#define T1CONbits	usbSimT1CON
+#define TXSTA1bits	usbSimTXSTA1
+#define RCSTA1bits	usbSimRCSTA1
+#define BAUDCON1bits	usbSimBAUDCON1
+#define RCREG1		(usbSimRCREG1())
+#define TXREG1		(*usbSimTXREG1())
+
+/* Objects XC8 would place at a fixed address are placed in the emulated SIE's view of RAM by usbSimInit() */
+#define __at(addr)
+
+extern void *usbSimAddrToPtr(const uint16_t addr);
+extern uint16_t usbSimPtrToAddr(const volatile void *ptr);
+#define addrToPtr(addr) usbSimAddrToPtr(addr)
+#define ptrToAddr(ptr) usbSimPtrToAddr(ptr)
+
+/* Lets the emulated SIE time how long each transaction waited between completing and being serviced */
+extern void usbSimServiced(const uint8_t packet);
+#define USB_TRANSACTION_HOOK(packet) usbSimServiced(packet)
+
+#pragma pack(1)
+
+#endif	/* XC_H */
@@ -24,6 +24,8 @@
 #include "usbTypes.h"
 #include "usbRequests.h"
 #include "usbCDC.h"
+#include "usbStats.h"
+#include "usbProfile.h"
 
 /*
  * @file
@@ -32,8 +34,6 @@
  * @date 2015/01/20
  */
 
-#define NULL	((void *)0)
-
 volatile usbDeviceState usbState;
 volatile usbEP_t usbPacket;
 volatile bool usbSuspended, usbAttachable;
@@ -46,13 +46,55 @@ volatile bool usbStageLock1 = false, usbStageLock2 = false;
 
 usbEPStatus_t usbStatusInEP[USB_ENDPOINTS];
 usbEPStatus_t usbStatusOutEP[USB_ENDPOINTS];
+#ifdef USB_PROFILE
+/* When usbDispatch() started, which is when the transactions it finds were picked up */
+uint16_t usbProfileEntry;
+#endif
+#ifdef USB_POLLED
+/* Whether usbTask() is polling the SIE, and how many frames it has seen go by without a transaction */
+volatile bool usbPolling;
+uint8_t usbIdleFrames;
+#endif
 /* Defines the buffer descriptor table and places it at it's fixed address in RAM */
 volatile usbBDTEntry_t usbBDT[USB_BDT_ENTRIES] __at(USB_BDT_ADDR);
 /* Define endpoint 0's buffers */
 volatile usbSetupPacket_t usbEP0Setup __at(USB_EP0_SETUP_ADDR);
 volatile uint8_t usbEP0Data[USB_EP0_DATA_LEN] __at(USB_EP0_DATA_ADDR);
-/* And endpoint 2's */
-volatile uint8_t usbEP2In[USB_EP2_IN_LEN] __at(USB_EP2_IN_ADDR);
+
+/*
+ * Class drivers' queues, rings and buffer descriptors are also worked on from the USB interrupt,
+ * so they hold that off while manipulating them. The state to restore is handed back to the caller
+ * so a lock taken from an interrupt can't clobber one the main loop holds.
+ */
+bool usbLock()
+{
+	bool state = PIE3bits.USBIE;
+	PIE3bits.USBIE = 0;
+	return state;
+}
+
+void usbUnlock(const bool state)
+{
+	PIE3bits.USBIE = state;
+}
+
+/*
+ * Registers the handler usbIRQ() calls, along with context, for each completed transaction on an endpoint.
+ * Handlers are cleared by a bus reset and by the host setting a configuration.
+ */
+void usbRegisterEPHandler(uint8_t ep, uint8_t dir, usbEPHandler_t handler, void *context)
+{
+	usbEPStatus_t *epStatus;
+	if (dir == USB_DIR_OUT)
+		epStatus = &usbStatusOutEP[ep];
+	else
+		epStatus = &usbStatusInEP[ep];
+	epStatus->handler = handler;
+	epStatus->context = context;
+}
+
+void usbServiceCtrlEPOut(void *context);
+void usbServiceCtrlEPIn(void *context);
 
 void usbInit()
 {
@@ -69,6 +111,9 @@ void usbInit()
 	usbAttachable = false;
 
 	usbStatusInEP[0].epLen = USB_EP0_DATA_LEN;
+#ifdef USB_PROFILE
+	usbProfileInit();
+#endif
 }
 
 void usbReset()
@@ -144,14 +189,22 @@ void usbReset()
 		usbStatusInEP[i].ep.epNum = i;
 		usbStatusInEP[i].ep.dir = USB_DIR_IN;
 		usbStatusInEP[i].ep.buff = 0;
+		usbStatusInEP[i].armedCount = 0;
+		usbStatusInEP[i].gatherEnds = 0;
 		usbStatusOutEP[i].value = 0;
 		usbStatusOutEP[i].xferCount = 0;
 		usbStatusOutEP[i].ep.value = 0;
 		usbStatusOutEP[i].ep.epNum = i;
 		usbStatusOutEP[i].ep.dir = USB_DIR_OUT;
 		usbStatusOutEP[i].ep.buff = 0;
+		usbRegisterEPHandler(i, USB_DIR_IN, NULL, NULL);
+		usbRegisterEPHandler(i, USB_DIR_OUT, NULL, NULL);
 	}
 
+	/* EP0 is always our default control endpoint */
+	usbRegisterEPHandler(0, USB_DIR_OUT, usbServiceCtrlEPOut, NULL);
+	usbRegisterEPHandler(0, USB_DIR_IN, usbServiceCtrlEPIn, NULL);
+
 	/* Prepare for an EP0 Setup packet */
 	UEP0 = 0x16;
 	usbBDT[0].count = USB_EP0_SETUP_LEN;
@@ -204,10 +257,15 @@ void usbAttach()
 	/* Except, ignore reset and idle conditions for the time being */
 	UIE = 0x6E;
 
-	/* And enable USB interrupts */
+	/* And enable USB interrupts, unless the SIE is polled */
 	RCONbits.IPEN = 1;
-	IPR3bits.USBIP = 1;
+	IPR3bits.USBIP = USB_IRQ_PRIORITY;
+#ifndef USB_POLLED
 	PIE3bits.USBIE = 1;
+#else
+	usbPolling = true;
+	usbIdleFrames = 0;
+#endif
 
 	/* Try to attach to bus */
 	while (UCONbits.USBEN == 0)
@@ -266,47 +324,153 @@ void usbHandleStall()
 	UIRbits.STALLIF = 0;
 }
 
+/*
+ * Packet copy kernels, one per kind of source so the per-byte loops carry no source checks.
+ * Pointers are kept in locals so they stay in the FSRs (or TBLPTR) for the whole copy, and the
+ * loops are unrolled by eight which covers both EP0's 8 byte and the data endpoints' 64 byte
+ * packets without ever reaching the tail loop.
+ */
+void usbCopyFromMem(volatile uint8_t *dst, const volatile uint8_t *src, uint8_t count)
+{
+	while (count >= 8)
+	{
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		count -= 8;
+	}
+	while (count--)
+		*dst++ = *src++;
+}
+
+#ifdef __XC8
+#define usbTableRead(dst) \
+	asm("TBLRD*+"); \
+	*dst++ = TABLAT
+#endif
+
+void usbCopyFromFlash(volatile uint8_t *dst, const uint8_t *src, uint8_t count)
+{
+#ifdef __XC8
+	/*
+	 * Stream the data out with post-incrementing table reads. The compiler does not know
+	 * we use TBLPTR here, so preserve it for whatever we might have interrupted.
+	 */
+	uint16_t addr = ptrToAddr(src);
+	uint8_t savedL = TBLPTRL, savedH = TBLPTRH, savedU = TBLPTRU;
+
+	TBLPTRU = 0;
+	TBLPTRH = addr >> 8;
+	TBLPTRL = addr;
+	while (count >= 8)
+	{
+		usbTableRead(dst);
+		usbTableRead(dst);
+		usbTableRead(dst);
+		usbTableRead(dst);
+		usbTableRead(dst);
+		usbTableRead(dst);
+		usbTableRead(dst);
+		usbTableRead(dst);
+		count -= 8;
+	}
+	while (count--)
+	{
+		usbTableRead(dst);
+	}
+
+	TBLPTRL = savedL;
+	TBLPTRH = savedH;
+	TBLPTRU = savedU;
+#else
+	while (count--)
+		*dst++ = *src++;
+#endif
+}
+
+/*
+ * Copies count bytes of a gathered transfer into sendBuff, moving on
+ * through the segment list each time the current segment runs out.
+ */
+void usbServiceEPGather(volatile uint8_t *sendBuff, usbEPStatus_t *epStatus, uint8_t count)
+{
+	uint8_t chunk;
+
+	while (count != 0)
+	{
+		if (epStatus->segmentLeft == 0)
+		{
+			epStatus->buffSrc = epStatus->segment->source;
+			if (epStatus->buffSrc == USB_BUFFER_SRC_FLASH)
+				epStatus->buffer.flashPtr = epStatus->segment->data;
+			else
+				epStatus->buffer.memPtr = (void *)epStatus->segment->data;
+			epStatus->segmentLeft = epStatus->segment->len;
+			++epStatus->segment;
+			continue;
+		}
+
+		chunk = count;
+		if (chunk > epStatus->segmentLeft)
+			chunk = epStatus->segmentLeft;
+		if (epStatus->buffSrc == USB_BUFFER_SRC_FLASH)
+		{
+			usbCopyFromFlash(sendBuff, epStatus->buffer.flashBuff, chunk);
+			epStatus->buffer.flashBuff += chunk;
+		}
+		else
+		{
+			usbCopyFromMem(sendBuff, epStatus->buffer.memBuff, chunk);
+			epStatus->buffer.memBuff += chunk;
+		}
+		sendBuff += chunk;
+		count -= chunk;
+		epStatus->segmentLeft -= chunk;
+	}
+}
+
 uint8_t usbServiceEPWrite(volatile usbBDTEntry_t *epBD, uint8_t ep)
 {
-	uint8_t ret, sendCount = usbStatusInEP[ep].epLen;
+	usbEPStatus_t *epStatus = &usbStatusInEP[ep];
+	uint8_t ret, sendCount = epStatus->epLen;
 	volatile uint8_t *sendBuff;
 
-	if (usbStatusInEP[ep].xferCount < usbStatusInEP[ep].epLen)
-		sendCount = usbStatusInEP[ep].xferCount;
+	if (epStatus->xferCount < epStatus->epLen)
+		sendCount = epStatus->xferCount;
 	/* Adjust the count of how much remains and prepare the transfer */
-	usbStatusInEP[ep].xferCount -= sendCount;
+	epStatus->xferCount -= sendCount;
 	epBD->count = sendCount;
 	ret = sendCount;
-	sendBuff = (volatile uint8_t *)epBD->address;
-	/* Copy the data to send this round from the user buffer */
-	if (usbStatusInEP[ep].buffSrc == USB_BUFFER_SRC_MEM)
+	/* Gathered transfers are packed from however many segments it takes to fill the packet */
+	if (epStatus->gather)
 	{
-		while (sendCount--)
-			*sendBuff++ = *usbStatusInEP[ep].buffer.memBuff++;
+		usbServiceEPGather(addrToPtr(epBD->address), epStatus, sendCount);
+		if (epStatus->xferCount == 0)
+			epStatus->gather = 0;
+		return ret;
 	}
-	else
+	/* If the data already lives in USB RAM, just point the SIE straight at it */
+	if (epStatus->buffSrc == USB_BUFFER_SRC_USB_RAM)
 	{
-		if (usbStatusInEP[ep].multiPart)
-		{
-			while (usbStatusInEP[ep].partCount <= sendCount)
-			{
-				sendCount -= usbStatusInEP[ep].partCount;
-				while (usbStatusInEP[ep].partCount--)
-					*sendBuff++ = *usbStatusInEP[ep].buffer.flashBuff++;
-				if (usbStatusInEP[ep].partDesc->numDesc != usbStatusInEP[ep].part)
-				{
-					const usbMultiPartDesc_t *nextPart = &usbStatusInEP[ep].partDesc->descriptors[usbStatusInEP[ep].part++];
-					usbStatusInEP[ep].partCount = nextPart->length;
-					usbStatusInEP[ep].buffer.flashPtr = nextPart->descriptor;
-				}
-			}
-			if (usbStatusInEP[ep].xferCount == 0)
-				usbStatusInEP[ep].multiPart = 0;
-			usbStatusInEP[ep].partCount -= sendCount;
-		}
-		while (sendCount--)
-			*sendBuff++ = *usbStatusInEP[ep].buffer.flashBuff++;
+		epBD->address = ptrToAddr(epStatus->buffer.memBuff);
+		epStatus->buffer.memBuff += sendCount;
+		return ret;
 	}
+	sendBuff = addrToPtr(epBD->address);
+	/* Copy the data to send this round from the user buffer */
+	if (epStatus->buffSrc == USB_BUFFER_SRC_MEM)
+	{
+		usbCopyFromMem(sendBuff, epStatus->buffer.memBuff, sendCount);
+		epStatus->buffer.memBuff += sendCount;
+		return ret;
+	}
+	usbCopyFromFlash(sendBuff, epStatus->buffer.flashBuff, sendCount);
+	epStatus->buffer.flashBuff += sendCount;
 	return ret;
 }
 
@@ -324,28 +488,176 @@ void usbServiceCtrlEPWrite(volatile usbBDTEntry_t *ep0BD)
 
 uint8_t usbServiceEPWriteArm(volatile usbBDTEntry_t *epBD, uint8_t ep)
 {
-	uint8_t ret;
-	bool lastDTS;
+	uint8_t ret = 0;
+	uint8_t gathered = usbStatusInEP[ep].gather;
 
-	if (usbStatusInEP[ep].xferCount == 0)
+	if (usbStatusInEP[ep].xferCount != 0)
+	{
+		ret = usbServiceEPWrite(epBD, ep);
+		/* A transfer ending in a full packet has to be followed by a ZLP or another transfer */
+		usbStatusInEP[ep].zlpPending = !usbStatusInEP[ep].noZLP &&
+			usbStatusInEP[ep].xferCount == 0 && ret == usbStatusInEP[ep].epLen;
+		/* Note if this packet finishes the transfer so completion can be signalled when it goes out */
+		if (usbStatusInEP[ep].xferCount == 0)
+		{
+			usbStatusInEP[ep].xferEnds |= 1 << ((uint8_t)(epBD - usbBDT) & 1);
+			if (gathered)
+				usbStatusInEP[ep].gatherEnds |= 1 << ((uint8_t)(epBD - usbBDT) & 1);
+		}
+	}
+	else if (usbStatusInEP[ep].zlpPending)
+	{
+		epBD->count = 0;
+		usbStatusInEP[ep].zlpPending = 0;
+	}
+	else
 		return 0;
 
-	usbStatusInEP[ep].ep.buff ^= 1;
-	lastDTS = usbBDT[usbStatusInEP[ep].ep.value].status.dataToggleSync;
-	usbStatusInEP[ep].ep.buff ^= 1;
-	ret = usbServiceEPWrite(epBD, ep);
-
+	/*
+	 * The toggle is tracked per endpoint rather than read back from the other
+	 * ping-pong descriptor as that one may well still be owned by the SIE.
+	 */
 	epBD->status.value = 0;
-	if (lastDTS)
-		epBD->status.dataToggleSync = 0;
-	else
-		epBD->status.dataToggleSync = 1;
+	epBD->status.dataToggleSync = usbStatusInEP[ep].dataToggle;
 	epBD->status.dataToggleSyncEn = 1;
 	epBD->status.usbOwned = 1;
+	usbStatusInEP[ep].dataToggle ^= 1;
+	++usbStatusInEP[ep].armedCount;
 
 	return ret;
 }
 
+/*
+ * Arms as many of the endpoint's ping-pong buffer descriptors as there is data for,
+ * staging through the endpoint's even and odd buffers at buffAddr unless the data is already in USB RAM.
+ * Called with no transfer left to stage, it sends the ZLP owed by a transfer that ended on a packet
+ * boundary, so the owner should start any follow-on transfer first. Returns the number of bytes queued.
+ */
+uint8_t usbServiceEPWriteQueue(uint8_t ep)
+{
+	uint8_t ret = 0;
+	usbEP_t next;
+
+	while (usbStatusInEP[ep].armedCount < 2 &&
+		(usbStatusInEP[ep].xferCount != 0 || usbStatusInEP[ep].zlpPending))
+	{
+		/* A ZLP only goes out on a call made once the transfer has been fully staged */
+		if (usbStatusInEP[ep].xferCount == 0 && ret != 0)
+			break;
+		/* The SIE consumes the descriptor at ep.buff first, so fill in behind any already armed */
+		next.value = usbStatusInEP[ep].ep.value;
+		next.buff ^= usbStatusInEP[ep].armedCount;
+		if (next.buff)
+			usbBDT[next.value].address = usbStatusInEP[ep].buffAddr + usbStatusInEP[ep].epLen;
+		else
+			usbBDT[next.value].address = usbStatusInEP[ep].buffAddr;
+		ret += usbServiceEPWriteArm(&usbBDT[next.value], ep);
+	}
+	return ret;
+}
+
+/*
+ * Keeps both of ep's IN buffer descriptors armed for as long as there is data, next(context) being
+ * called to start the owner's next queued transfer with usbServiceEPStartIn() each time the current one
+ * is fully staged. It returns false if nothing is queued. Once nothing follows, a transfer that ended on
+ * a packet boundary gets its ZLP straight away if terminate is set, otherwise the owner sends it later with
+ * usbServiceEPWriteQueue(), giving more data the chance to follow on instead.
+ */
+void usbServiceEPQueueIn(uint8_t ep, bool (*next)(void *context), void *context, const bool terminate)
+{
+	while (usbStatusInEP[ep].armedCount < 2)
+	{
+		if (usbStatusInEP[ep].xferCount == 0 && !next(context))
+		{
+			if (terminate)
+				usbServiceEPWriteQueue(ep);
+			return;
+		}
+		usbServiceEPWriteQueue(ep);
+	}
+}
+
+/*
+ * Makes len bytes at buffer ep's current IN transfer, handed to the SIE in place if they are in USB RAM.
+ */
+void usbServiceEPStartIn(uint8_t ep, uint8_t *buffer, uint16_t len)
+{
+	usbEPStatus_t *epStatus = &usbStatusInEP[ep];
+	if (usbIsUSBRAM(buffer))
+		epStatus->buffSrc = USB_BUFFER_SRC_USB_RAM;
+	else
+		epStatus->buffSrc = USB_BUFFER_SRC_MEM;
+	epStatus->buffer.memPtr = buffer;
+	epStatus->xferCount = len;
+}
+
+/*
+ * Hands a ring of OUT packet slots, epLen bytes apart from slots and mask + 1 of them, to the SIE in ring
+ * order from slot first on, until both of ep's OUT buffer descriptors are armed or free slots run out.
+ */
+void usbServiceEPArmSlots(uint8_t ep, volatile uint8_t *slots, const uint8_t mask, const uint8_t first, const uint8_t free)
+{
+	usbEPStatus_t *epStatus = &usbStatusOutEP[ep];
+	volatile usbBDTEntry_t *epBD;
+	usbEP_t next;
+
+	while (epStatus->armedCount < 2 && epStatus->armedCount < free)
+	{
+		next.value = epStatus->ep.value;
+		next.buff ^= epStatus->armedCount;
+		epBD = &usbBDT[next.value];
+		epBD->count = epStatus->epLen;
+		epBD->address = ptrToAddr(slots + (uint16_t)((first + epStatus->armedCount) & mask) * epStatus->epLen);
+		epBD->status.value = 0;
+		epBD->status.dataToggleSync = epStatus->dataToggle;
+		epBD->status.dataToggleSyncEn = 1;
+		epBD->status.usbOwned = 1;
+		epStatus->dataToggle ^= 1;
+		++epStatus->armedCount;
+	}
+}
+
+/*
+ * Starts an IN transfer on ep gathered from count segments, packed into full packets in the
+ * endpoint's buffers at buffAddr. The segments must stay valid until func is called on completion,
+ * which is called in place of the endpoint's own func for this transfer alone.
+ *
+ * Only endpoints whose owner reserves the two packet buffers at buffAddr for staging copies and keeps
+ * its transfers going with usbServiceEPWriteQueue() or usbServiceEPQueueIn() can take gathered transfers.
+ * In this tree that is the raw interface's IN endpoint, where a gathered transfer goes out between
+ * whatever usbRawSubmitIn() transfers it was started after and before. CDC data endpoints send their
+ * transmit stream from those buffers, so must not be used, and take usbUARTSendSegments() instead.
+ * Returns false if the endpoint is still busy with a previous transfer, has no staging buffers or
+ * there is nothing to send.
+ */
+bool usbServiceEPWriteGather(uint8_t ep, const usbSegment_t *segments, uint8_t count, void (*func)())
+{
+	usbEPStatus_t *epStatus = &usbStatusInEP[ep];
+	uint16_t total = 0;
+	uint8_t i;
+	bool lockState;
+
+	for (i = 0; i < count; ++i)
+		total += segments[i].len;
+	if (total == 0 || epStatus->buffAddr == 0)
+		return false;
+
+	lockState = usbLock();
+	if (epStatus->xferCount != 0 || epStatus->xferEnds != 0)
+	{
+		usbUnlock(lockState);
+		return false;
+	}
+	epStatus->segment = segments;
+	epStatus->segmentLeft = 0;
+	epStatus->gather = 1;
+	epStatus->xferCount = total;
+	epStatus->gatherFunc = func;
+	usbServiceEPWriteQueue(ep);
+	usbUnlock(lockState);
+	return true;
+}
+
 uint8_t usbServiceEPRead(volatile usbBDTEntry_t *epBD, uint8_t ep)
 {
 	uint8_t ret, readCount = epBD->count;
@@ -356,8 +668,8 @@ uint8_t usbServiceEPRead(volatile usbBDTEntry_t *epBD, uint8_t ep)
 	usbStatusOutEP[ep].xferCount -= readCount;
 	ret = readCount;
 	/* Copy the received data to the user buffer */
-	while (readCount--)
-		*usbStatusOutEP[ep].buffer.memBuff++ = *recvBuff++;
+	usbCopyFromMem(usbStatusOutEP[ep].buffer.memBuff, recvBuff, readCount);
+	usbStatusOutEP[ep].buffer.memBuff += readCount;
 	return ret;
 }
 
@@ -381,10 +693,10 @@ void usbServiceCtrlEPRead(volatile usbBDTEntry_t *ep0BD)
 	}
 	else
 	{
-		/* Re-arm the endpoint for the next SETUP token */
+		/* Re-arm the endpoint for the next SETUP token, which must land where the request handlers look for it */
 		ep0BD = &usbBDT[usbStatusOutEP[0].ep.value];
-		ep0BD->count = USB_EP0_DATA_LEN;
-		ep0BD->address = USB_EP0_DATA_ADDR;
+		ep0BD->count = USB_EP0_SETUP_LEN;
+		ep0BD->address = USB_EP0_SETUP_ADDR;
 		ep0BD->status.value = 0;
 		ep0BD->status.dataToggleSync = 0;
 		ep0BD->status.dataToggleSyncEn = 1;
@@ -422,7 +734,7 @@ void usbHandleDataCtrlEP()
 	}
 	else if (usbCtrlState == USB_CTRL_STATE_TX)
 	{
-		volatile usbSetupPacket_t *packet = addrToPtr(usbBDT[usbStatusOutEP[0].ep.value].address);
+		volatile usbSetupPacket_t *packet = addrToPtr(USB_EP0_SETUP_ADDR);
 		/* Setup the data area */
 		ep0BD = &usbBDT[usbStatusInEP[0].ep.value];
 		ep0BD->address = USB_EP0_DATA_ADDR;
@@ -487,7 +799,7 @@ void usbHandleStatusCtrlEP()
 void usbServiceCtrlEPComplete()
 {
 	volatile usbBDTEntry_t *ep0BD;
-	/* Values in []'s indicate DTS bits values.
+	/* Values in []'s indicate DTS bits values. */
 
 	/* Re-enable packet processing after a setup transaction */
 	UCONbits.PKTDIS = 0;
@@ -588,7 +900,15 @@ void usbHandleCtrlEPSetup()
 	/* Handle the request */
 	processed = usbHandleStandardRequest(addrToPtr(usbBDT[usbPacket.value].address));
 	if (!processed)
+	{
 		usbHandleCDCRequest(&usbBDT[usbPacket.value]);
+#ifdef USB_STATS
+		usbHandleStatsRequest(&usbBDT[usbPacket.value]);
+#endif
+#ifdef USB_PROFILE
+		usbHandleProfileRequest(&usbBDT[usbPacket.value]);
+#endif
+	}
 
 	usbServiceCtrlEPComplete();
 }
@@ -625,7 +945,7 @@ void usbHandleCtrlEPIn()
 	if (usbState == USB_STATE_ADDRESSING)
 	{
 		/* Get the setup packet data area and check that the reason we're here is a set address request */
-		volatile usbSetupPacket_t *packet = addrToPtr(usbBDT[usbStatusOutEP[0].ep.value].address);
+		volatile usbSetupPacket_t *packet = addrToPtr(USB_EP0_SETUP_ADDR);
 		if (packet->requestType.type != USB_REQUEST_TYPE_STANDARD ||
 			packet->request != USB_REQUEST_SET_ADDRESS ||
 			packet->value.address.addrH != 0)
@@ -676,26 +996,390 @@ void usbHandleCtrlEPIn()
 	}
 }
 
-void usbServiceCtrlEP()
+void usbServiceCtrlEPOut(void *context)
 {
-	if (usbPacket.epNum != 0)
-		return;
+	volatile usbBDTEntry_t *ep0BD = &usbBDT[usbPacket.value];
+	(void)context;
+
 	usbStatusTimeout = USB_STATUS_TIMEOUT;
-	if (usbPacket.dir == USB_DIR_OUT)
+	if (ep0BD->status.pid == USB_PID_SETUP)
+		usbHandleCtrlEPSetup();
+	else
+		usbHandleCtrlEPOut();
+}
+
+void usbServiceCtrlEPIn(void *context)
+{
+	(void)context;
+	usbStatusTimeout = USB_STATUS_TIMEOUT;
+	usbHandleCtrlEPIn();
+}
+
+void usbHandleReset()
+{
+	usbProfileDeclare(start);
+	usbProfileStart(start);
+	/* Ready processing getting an address, etc */
+	usbReset();
+#ifndef USB_POLLED
+	PIE3bits.USBIE = 1;
+#else
+	/* Traffic follows a reset, so take it polled */
+	usbPolling = true;
+	usbIdleFrames = 0;
+#endif
+	usbState = USB_STATE_WAITING;
+	UIRbits.URSTIF = 0;
+	usbProfileEnd(USB_PROFILE_RESET, start);
+}
+
+void usbHandleError()
+{
+#ifdef USB_STATS
+	/* Count each error class that was flagged before the flags go */
+	uint8_t errors = UEIR;
+	uint8_t i;
+	for (i = 0; errors != 0; ++i, errors >>= 1)
 	{
-		volatile usbBDTEntry_t *ep0BD = &usbBDT[usbPacket.value];
+		if ((errors & 1) && usbStats.errors[i] != 0xFFFF)
+			++usbStats.errors[i];
+	}
+#endif
+	/* Clear the error condition */
+	UEIR = 0;
+	UIRbits.UERRIF = 0;
+}
 
-		if (ep0BD->status.pid == USB_PID_SETUP)
-			usbHandleCtrlEPSetup();
-		else
-			usbHandleCtrlEPOut();
+void usbHandleActivity()
+{
+	UIRbits.ACTVIF = 0;
+	usbWakeup();
+}
+
+void usbHandleIdle()
+{
+	usbSuspend();
+	UIRbits.IDLEIF = 0;
+}
+
+void usbServiceSOF()
+{
+	usbProfileDeclare(start);
+	usbProfileStart(start);
+	/* Check the status stage timeout and dispatch as necessary */
+	if (usbStatusTimeout != 0)
+		--usbStatusTimeout;
+	else
+		usbHandleStatusCtrlEP();
+	usbCDCServiceSOF();
+	usbProfileEnd(USB_PROFILE_SOF, start);
+}
+
+void usbHandleSOF()
+{
+	UIRbits.SOFIF = 0;
+	usbServiceSOF();
+}
+
+/*
+ * Processes the transaction described by usbPacket: advances the endpoint's
+ * ping-pong state and passes the transaction on to the endpoint's handler.
+ */
+void usbServiceTransaction()
+{
+	uint8_t endpointNum = usbPacket.epNum;
+	usbEPStatus_t *epStatus;
+#ifdef USB_STATS
+	/* Take the count now as the handler may re-arm the buffer descriptor */
+	uint8_t count = usbBDT[usbPacket.value].count;
+#endif
+#ifdef USB_PROFILE
+	uint8_t path;
+	uint16_t start = usbProfileTime();
+	/* Work out the path now, before the handler re-arms the buffer descriptor */
+	if (endpointNum != 0)
+		path = USB_PROFILE_DATA;
+	else if (usbPacket.dir == USB_DIR_IN)
+		path = USB_PROFILE_CTRL_IN;
+	else if (usbBDT[usbPacket.value].status.pid == USB_PID_SETUP)
+		path = USB_PROFILE_SETUP;
+	else
+		path = USB_PROFILE_CTRL_OUT;
+#endif
+#ifdef USB_TRANSACTION_HOOK
+	USB_TRANSACTION_HOOK(usbPacket.value);
+#endif
+
+	if (usbPacket.dir == USB_DIR_OUT)
+	{
+		epStatus = &usbStatusOutEP[endpointNum];
+		epStatus->ep.buff ^= 1;
 	}
 	else
-		usbHandleCtrlEPIn();
+	{
+		uint8_t buffMask = 1 << usbPacket.buff;
+		epStatus = &usbStatusInEP[endpointNum];
+		epStatus->ep.buff ^= 1;
+		if (epStatus->armedCount != 0)
+			--epStatus->armedCount;
+		/* If that was the last packet of a transfer, hand its buffer back to whoever started it */
+		if (epStatus->xferEnds & buffMask)
+		{
+			epStatus->xferEnds &= ~buffMask;
+			if (epStatus->gatherEnds & buffMask)
+			{
+				epStatus->gatherEnds &= ~buffMask;
+				if (epStatus->gatherFunc != NULL)
+					epStatus->gatherFunc();
+			}
+			else if (epStatus->func != NULL)
+				epStatus->func();
+		}
+	}
+
+	/* And hand it to whatever is servicing the endpoint */
+	if (epStatus->handler != NULL)
+		epStatus->handler(epStatus->context);
+
+#ifdef USB_STATS
+	if (endpointNum < USB_STATS_ENDPOINTS)
+	{
+		usbEPStats_t *stats = &usbStats.ep[endpointNum][usbPacket.dir];
+		if (stats->packets != 0xFFFF)
+			++stats->packets;
+		stats->bytes += count;
+		if (stats->bytes < count)
+			stats->bytes = 0xFFFFFFFF;
+		/* EP0 is armed by the control transfer state machine rather than through armedCount */
+		if (endpointNum != 0 && epStatus->armedCount == 0 && stats->unarmed != 0xFFFF)
+			++stats->unarmed;
+	}
+#endif
+	usbProfileEnd(path, start);
 }
 
-void usbIRQ()
+void usbHandleTransactions()
+{
+	/* Never take more than the USTAT FIFO holds, leaving the rest for the interrupt to come back to */
+	uint8_t count = USB_USTAT_FIFO_LEN;
+
+	/* If we are not yet configured, process no further. */
+	if (usbState < USB_STATE_WAITING)
+		return;
+
+	while (UIRbits.TRNIF == 1 && count-- != 0)
+	{
+		/* Do something about the transaction data */
+		usbPacket.value = (USTAT & 0x7E) >> 1;
+		/* Mark the entry as processed */
+		UIRbits.TRNIF = 0;
+		usbProfileEnd(USB_PROFILE_LATENCY, usbProfileEntry);
+		usbServiceTransaction();
+	}
+}
+
+#ifdef USB_DEFERRED_IRQ
+/*
+ * In deferred mode the interrupt only records what happened. USTAT values go into a
+ * single-producer, single-consumer queue the interrupt fills and usbTask() drains;
+ * neither side writes the other's index so no locking is needed.
+ */
+volatile usbEP_t usbXferQueue[USB_XFER_QUEUE_LEN];
+volatile uint8_t usbXferHead, usbXferTail;
+volatile uint8_t usbSOFCount, usbSOFSeen;
+volatile bool usbResetPending, usbStallPending;
+#ifdef USB_PROFILE
+/* When each queued transaction was picked up */
+uint16_t usbXferQueueTime[USB_XFER_QUEUE_LEN];
+#endif
+
+void usbDeferReset()
+{
+	usbResetPending = true;
+	/* Nothing else is worth looking at until usbTask() has done the reset */
+	UIEbits.TRNIE = 0;
+	UIRbits.URSTIF = 0;
+}
+
+void usbDeferStall()
+{
+	usbStallPending = true;
+	UIRbits.STALLIF = 0;
+}
+
+void usbDeferSOF()
+{
+	++usbSOFCount;
+	UIRbits.SOFIF = 0;
+}
+
+#ifdef USB_SPLIT_IRQ
+/*
+ * Services a data endpoint transaction from the interrupt. usbTask() may have been
+ * interrupted part way through a control transaction, so its usbPacket is put back afterwards.
+ */
+void usbServiceDataTransaction(const uint8_t packet)
+{
+	uint8_t saved = usbPacket.value;
+	usbPacket.value = packet;
+	usbServiceTransaction();
+	usbPacket.value = saved;
+}
+#endif
+
+void usbDeferTransactions()
+{
+	usbEP_t packet;
+	/* As for usbHandleTransactions(), which bounds how long the interrupt can spend here */
+	uint8_t count = USB_USTAT_FIFO_LEN;
+
+	if (usbState < USB_STATE_WAITING)
+		return;
+
+	while (UIRbits.TRNIF == 1 && count-- != 0)
+	{
+		packet.value = (USTAT & 0x7E) >> 1;
+#ifdef USB_SPLIT_IRQ
+		/* Anything but EP0 is dealt with on the spot so its buffers are re-armed without waiting on usbTask() */
+		if (packet.epNum != 0)
+		{
+			UIRbits.TRNIF = 0;
+			usbProfileEnd(USB_PROFILE_LATENCY, usbProfileEntry);
+			usbServiceDataTransaction(packet.value);
+			continue;
+		}
+#endif
+		/* If the queue is full, leave the rest in the SIE's USTAT FIFO until usbTask() catches up */
+		if ((uint8_t)(usbXferHead - usbXferTail) == USB_XFER_QUEUE_LEN)
+		{
+			UIEbits.TRNIE = 0;
+			return;
+		}
+		usbXferQueue[usbXferHead & (USB_XFER_QUEUE_LEN - 1)].value = packet.value;
+#ifdef USB_PROFILE
+		usbXferQueueTime[usbXferHead & (USB_XFER_QUEUE_LEN - 1)] = usbProfileEntry;
+#endif
+		UIRbits.TRNIF = 0;
+		++usbXferHead;
+	}
+}
+#endif
+
+#ifdef USB_POLLED
+uint8_t usbDispatch();
+#endif
+
+void usbTask()
+{
+#ifdef USB_DEFERRED_IRQ
+	bool lockState;
+
+	if (usbResetPending)
+	{
+		usbTaskLock(lockState);
+		/* Anything queued before the reset is meaningless now */
+		usbXferTail = usbXferHead;
+		usbResetPending = false;
+		usbHandleReset();
+		usbTaskUnlock(lockState);
+	}
+
+	if (usbStallPending)
+	{
+		usbStallPending = false;
+		usbHandleStall();
+	}
+
+	while (usbSOFSeen != usbSOFCount)
+	{
+		++usbSOFSeen;
+		usbServiceSOF();
+	}
+
+	/* A reset coming in part way through makes whatever is left in the queue meaningless */
+	while (usbXferTail != usbXferHead && !usbResetPending)
+	{
+		usbPacket.value = usbXferQueue[usbXferTail & (USB_XFER_QUEUE_LEN - 1)].value;
+		usbProfileEnd(USB_PROFILE_LATENCY, usbXferQueueTime[usbXferTail & (USB_XFER_QUEUE_LEN - 1)]);
+		++usbXferTail;
+		usbServiceTransaction();
+	}
+
+	/*
+	 * There is room in the queue again, so let the interrupt take any transactions held back.
+	 * A reset that came in meanwhile turned TRNIE off until it is done, so leave it be then, and
+	 * hold the interrupt off so one can't arrive between checking for it and turning TRNIE on.
+	 */
+	lockState = PIE3bits.USBIE;
+	PIE3bits.USBIE = 0;
+	if (!usbResetPending && usbState != USB_STATE_DETACHED)
+		UIEbits.TRNIE = 1;
+	PIE3bits.USBIE = lockState;
+#elif defined(USB_POLLED)
+#ifdef USB_ADAPTIVE_POLL
+	uint8_t seen;
+#endif
+
+	if (!usbPolling || usbState == USB_STATE_DETACHED)
+		return;
+	/*
+	 * A lock taken just as usbIRQ() handed back to polling can have turned the interrupt back on,
+	 * so make sure it is off before doing the interrupt's work here.
+	 */
+	PIE3bits.USBIE = 0;
+	PIR3bits.USBIF = 0;
+#ifndef USB_ADAPTIVE_POLL
+	usbDispatch();
+#else
+	seen = usbDispatch();
+	if (seen & USB_IRQ_TRN)
+		usbIdleFrames = 0;
+	else if ((seen & USB_IRQ_SOF) && ++usbIdleFrames == USB_ADAPTIVE_IDLE_FRAMES)
+	{
+		/* The bus has gone quiet, so leave it to the interrupt */
+		usbPolling = false;
+		PIE3bits.USBIE = 1;
+	}
+#endif
+#endif
+}
+
+/*
+ * Interrupt source handlers indexed by their UIR bit position, which is also the order in
+ * which they are serviced when several are pending: reset first, start-of-frame last.
+ */
+void (*const usbIRQHandlers[USB_IRQ_SOURCES])() =
 {
+#ifndef USB_DEFERRED_IRQ
+	usbHandleReset,
+	usbHandleError,
+	usbHandleActivity,
+	usbHandleTransactions,
+	usbHandleIdle,
+	usbHandleStall,
+	usbHandleSOF
+#else
+	usbDeferReset,
+	usbHandleError,
+	usbHandleActivity,
+	usbDeferTransactions,
+	usbHandleIdle,
+	usbDeferStall,
+	usbDeferSOF
+#endif
+};
+
+/* Position of the lowest set bit in a nibble, for turning the pending mask into a handler index */
+const uint8_t usbIRQFirstSource[16] = { 0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+
+/*
+ * Services whatever the SIE has pending, returning the sources there were.
+ */
+uint8_t usbDispatch()
+{
+	uint8_t pending, source, seen;
+	usbProfileStart(usbProfileEntry);
+
 	/*
 	 * When Single-Ended 0 condition clears and we are in the freshly attached state,
 	 * switch state processing to the "powered" state where we are unconfigured, but
@@ -712,84 +1396,80 @@ void usbIRQ()
 		usbState = USB_STATE_POWERED;
 	}
 
+	/* Take one snapshot of what needs servicing so idle sources cost nothing */
+	pending = UIR & UIE;
+	seen = pending;
+
+#ifndef USB_BENCH_LEGACY_DISPATCH
 	/* If we detect activity, ensure we are in an awake state */
-	if (UIRbits.ACTVIF == 1 && UIEbits.ACTVIE == 1)
+	if (pending & USB_IRQ_ACTV)
 	{
-		UIRbits.ACTVIF = 0;
-		usbWakeup();
+		usbHandleActivity();
+		pending &= ~USB_IRQ_ACTV;
 	}
 
 	/* If we are in a suspended state due to inactivity, ignore all further USB interrupt processors */
 	if (usbSuspended)
-		return;
+		return seen;
 
-	/* If we detect the USB reset condition then ready processing getting an address, etc */
-	if (UIRbits.URSTIF == 1 && UIEbits.URSTIE == 1)
-	{
-		usbReset();
-		PIE3bits.USBIE = 1;
-		usbState = USB_STATE_WAITING;
-		UIRbits.URSTIF = 0;
-	}
-
-	/* If we detect an idle condition, suspend activity */
-	if (UIRbits.IDLEIF == 1 && UIEbits.IDLEIE == 1)
+	while (pending != 0)
 	{
-		usbSuspend();
-		UIRbits.IDLEIF = 0;
-	}
-
-	/* If we detect a start of frame, check the status stage timeout and dispatch as necessary */
-	if (UIRbits.SOFIF == 1)
-	{
-		//if (UIEbits.SOFIE == 1);
-		UIRbits.SOFIF = 0;
-
-		if (usbStatusTimeout != 0)
-			--usbStatusTimeout;
+		if (pending & 0x0F)
+			source = usbIRQFirstSource[pending & 0x0F];
 		else
-			usbHandleStatusCtrlEP();
+			source = 4 + usbIRQFirstSource[pending >> 4];
+		/* Clear the lowest set bit, which is the source just picked */
+		pending &= pending - 1;
+		usbIRQHandlers[source]();
+		/* Drop anything the handler dealt with in passing, such as a reset clearing everything */
+		pending &= UIR;
 	}
-
-	/* If we detect a Stall handshake condition, process it */
+#else
+	/*
+	 * The chain of flag and enable tests the pending mask replaced, in its order, kept only so
+	 * host/usbBench can time the two against each other. The handlers are the table's, by UIR bit.
+	 */
+	(void)pending;
+	(void)source;
+	if (UIRbits.ACTVIF == 1 && UIEbits.ACTVIE == 1)
+		usbHandleActivity();
+	if (usbSuspended)
+		return seen;
+	if (UIRbits.URSTIF == 1 && UIEbits.URSTIE == 1)
+		usbIRQHandlers[0]();
+	if (UIRbits.IDLEIF == 1 && UIEbits.IDLEIE == 1)
+		usbIRQHandlers[4]();
+	if (UIRbits.SOFIF == 1 && UIEbits.SOFIE == 1)
+		usbIRQHandlers[6]();
 	if (UIRbits.STALLIF == 1 && UIEbits.STALLIE == 1)
-		usbHandleStall();
-
-	/* If we detect an USB error, process it */
+		usbIRQHandlers[5]();
 	if (UIRbits.UERRIF == 1 && UIEbits.UERRIE == 1)
-	{
-		/* Clear the error condition */
-		UEIR = 0;
-		UIRbits.UERRIF = 0;
-	}
-
-	/* If we are not yet configured, process no further. */
-	if (usbState < USB_STATE_WAITING)
-		return;
+		usbIRQHandlers[1]();
+	if (UIRbits.TRNIF == 1 && UIEbits.TRNIE == 1)
+		usbIRQHandlers[3]();
+#endif
+	return seen;
+}
 
-	/* If we detect the SIE has completed IO for a transaction, handle that transaction */
-	if (UIEbits.TRNIE == 1)
+void usbIRQ()
+{
+	usbProfileDeclare(start);
+	usbProfileStart(start);
+#ifndef USB_ADAPTIVE_POLL
+	usbDispatch();
+#else
+	/* Traffic has started up again, so go back to polling for it */
+	if (usbDispatch() & USB_IRQ_TRN)
 	{
-		while (UIRbits.TRNIF == 1)
-		{
-			uint8_t endpointNum;
-
-			/* Do something about the transaction data */
-			usbPacket.value = (USTAT & 0x7E) >> 1;
-			endpointNum = usbPacket.epNum;
-			/* Mark the entry as processed */
-			UIRbits.TRNIF = 0;
-
-			/* Process the data */
-			if (usbPacket.dir == USB_DIR_OUT)
-				usbStatusOutEP[endpointNum].ep.buff ^= 1;
-			else
-				usbStatusInEP[endpointNum].ep.buff ^= 1;
-
-			if (endpointNum == 0)
-				usbServiceCtrlEP();
-			else if (endpointNum == 1)
-				usbServiceCDCDataEP();
-		}
+		PIE3bits.USBIE = 0;
+		usbIdleFrames = 0;
+		usbPolling = true;
 	}
+#endif
+
+#if defined(USB_SPLIT_IRQ) && defined(USB_SPLIT_IRQ_RAISE)
+	if (usbResetPending || usbStallPending || usbSOFSeen != usbSOFCount || usbXferTail != usbXferHead)
+		USB_SPLIT_IRQ_RAISE();
+#endif
+	usbProfileEnd(USB_PROFILE_IRQ, start);
 }
@@ -32,7 +32,7 @@ extern "C"
 #endif
 
 #include <stdbool.h>
-#include "USBTypes.h"
+#include "usbTypes.h"
 
 extern void usbInit();
 extern void usbReset();
@@ -41,11 +41,43 @@ extern bool usbCanAttach();
 extern void usbAttach();
 extern void usbDetach();
 extern void usbIRQ();
+/*
+ * When built with USB_DEFERRED_IRQ defined, usbIRQ() only queues what the SIE reports and
+ * all request and endpoint processing happens in usbTask(), which must be called from the main loop.
+ * Otherwise usbTask() does nothing and everything is processed in usbIRQ().
+ *
+ * USB_SPLIT_IRQ builds on that: usbIRQ() also services transactions on the data endpoints itself,
+ * so it can stay on the high priority vector and keep their buffers moving, while control requests,
+ * SOF bookkeeping and resets wait for usbTask(). That may be called from the main loop or from a
+ * low priority interrupt handler, which USB_SPLIT_IRQ_RAISE(), if defined, is used to request
+ * whenever usbIRQ() leaves work for it, for example by setting the flag of a spare low priority interrupt.
+ *
+ * With USB_POLLED defined the USB interrupt is never enabled and usbTask() instead polls the SIE
+ * and does all the processing usbIRQ() would, so USB is only ever serviced where usbTask() is called.
+ * USB_ADAPTIVE_POLL does the same while there is traffic, but once USB_ADAPTIVE_IDLE_FRAMES frames
+ * go by without a transaction it enables the interrupt and usbTask() does nothing until usbIRQ()
+ * sees traffic again and hands back to polling.
+ *
+ * USB_TRANSACTION_HOOK(packet), if defined, is called with the buffer descriptor index of each transaction
+ * as it starts being serviced, whichever of the above does that, for example to time how long transactions wait.
+ */
+extern void usbTask();
+extern void usbRegisterEPHandler(uint8_t ep, uint8_t dir, usbEPHandler_t handler, void *context);
+extern bool usbLock();
+extern void usbUnlock(const bool state);
 
 extern void usbHandleDataCtrlEP();
 extern void usbHandleStatusCtrlEP();
+extern void usbCopyFromMem(volatile uint8_t *dst, const volatile uint8_t *src, uint8_t count);
+extern void usbCopyFromFlash(volatile uint8_t *dst, const uint8_t *src, uint8_t count);
 extern uint8_t usbServiceEPWrite(volatile usbBDTEntry_t *epBD, uint8_t ep);
 extern uint8_t usbServiceEPWriteArm(volatile usbBDTEntry_t *epBD, uint8_t ep);
+extern uint8_t usbServiceEPWriteQueue(uint8_t ep);
+extern void usbServiceEPQueueIn(uint8_t ep, bool (*next)(void *context), void *context, const bool terminate);
+extern void usbServiceEPStartIn(uint8_t ep, uint8_t *buffer, uint16_t len);
+extern void usbServiceEPArmSlots(uint8_t ep, volatile uint8_t *slots, const uint8_t mask, const uint8_t first,
+	const uint8_t free);
+extern bool usbServiceEPWriteGather(uint8_t ep, const usbSegment_t *segments, uint8_t count, void (*func)());
 extern uint8_t usbServiceEPRead(volatile usbBDTEntry_t *epBD, uint8_t ep);
 
 extern volatile usbEP_t usbPacket;
@@ -16,13 +16,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <xc.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include "usbTypes.h"
 #include "usb.h"
+#include "usbRequests.h"
 #include "usbCDC.h"
+#include "usbStats.h"
 #include "usbUART.h"
-#include "uart.h"
 
 /*
  * @file
@@ -31,77 +34,259 @@
  * @date 2015/02/18
  */
 
-#define USB_BUFFER_SRC_CHAR		2
+/* Depth of each port's send queue, which must be a power of two no larger than 128 */
+#ifndef USB_CDC_SEND_QUEUE_LEN
+#define USB_CDC_SEND_QUEUE_LEN	8
+#endif
+USB_STATIC_ASSERT((USB_CDC_SEND_QUEUE_LEN & (USB_CDC_SEND_QUEUE_LEN - 1)) == 0 &&
+	USB_CDC_SEND_QUEUE_LEN <= 128, cdcSendQueueLen);
+USB_STATIC_ASSERT((USB_CDC_IN_SLOTS & (USB_CDC_IN_SLOTS - 1)) == 0, cdcInSlots);
+USB_STATIC_ASSERT((USB_CDC_OUT_SLOTS & (USB_CDC_OUT_SLOTS - 1)) == 0, cdcOutSlots);
+USB_STATIC_ASSERT(USB_CDC_DATA_LEN == 8 || USB_CDC_DATA_LEN == 16 || USB_CDC_DATA_LEN == 32 ||
+	USB_CDC_DATA_LEN == 64, cdcDataLen);
+
+/*
+ * The UART bridge services its port's rings straight from EUSART1's interrupts, relying on the USB
+ * interrupt being unable to preempt it, so it cannot run with USB handling deferred or polled from the main loop.
+ */
+#if defined(USB_CDC_UART_BRIDGE) && (defined(USB_DEFERRED_IRQ) || defined(USB_POLLED))
+#error "USB_CDC_UART_BRIDGE cannot be used with USB_DEFERRED_IRQ or USB_POLLED"
+#endif
+
+/* The port the UART bridge runs on */
+#ifndef USB_CDC_BRIDGE_PORT
+#define USB_CDC_BRIDGE_PORT		0
+#endif
+USB_STATIC_ASSERT(USB_CDC_BRIDGE_PORT < USB_CDC_PORTS, cdcBridgePort);
+
+/* Oscillator frequency the UART bridge's baud rate divisor is worked out from */
+#ifndef USB_CDC_BRIDGE_FOSC
+#define USB_CDC_BRIDGE_FOSC		48000000UL
+#endif
+
+/* Number of frames a part filled packet may wait for more data before it is sent anyway */
+#ifndef USB_CDC_FLUSH_FRAMES
+#define USB_CDC_FLUSH_FRAMES	2
+#endif
+
+/* How many of the newest bytes the keep policy holds on to while DTR is low, a power of two no larger than 128 */
+#ifndef USB_CDC_KEEP_LEN
+#define USB_CDC_KEEP_LEN		64
+#endif
+USB_STATIC_ASSERT((USB_CDC_KEEP_LEN & (USB_CDC_KEEP_LEN - 1)) == 0 && USB_CDC_KEEP_LEN <= 128 &&
+	USB_CDC_KEEP_LEN <= USB_CDC_IN_SLOTS * USB_CDC_DATA_LEN, cdcKeepLen);
+
+/* Marks send queue entries made by the transmit stream rather than usbUARTSendBuffer() */
+#define USB_CDC_SRC_STREAM		3
 
 typedef struct
 {
 	uint8_t source;
-	union
-	{
-		void *mem;
-		const void *flash;
-		char ch;
-	} data;
+	uint8_t *data;
 	uint16_t len;
 } sendFIFOEntry_t;
 
-usbLineCoding_t usbCDCLineCoding;
-char usbCDCCtrlBuffer[64] __at(0x5D0);
-uint8_t dataFullness, readCounter;
+/* A port's packet buffers in USB RAM, laid out as USB_CDC_PORT_RAM_LEN describes */
+typedef struct
+{
+	uint8_t out[USB_CDC_OUT_SLOTS][USB_CDC_DATA_LEN];
+	uint8_t in[USB_CDC_IN_SLOTS][USB_CDC_DATA_LEN];
+	usbCDCNotification_t notification;
+	uint8_t notificationPad[USB_CDC_NOTIFY_LEN - sizeof(usbCDCNotification_t)];
+} usbCDCPortRAM_t;
 
-sendFIFOEntry_t sendFIFO[5];
-uint8_t sendFIFOCount, sendChar;
+USB_STATIC_ASSERT(sizeof(usbCDCPortRAM_t) == USB_CDC_PORT_RAM_LEN, cdcPortRAMLen);
 
-/* Define our endpoint 1 data buffers */
-volatile uint8_t usbEP1In[USB_EP1_IN_LEN] __at(USB_EP1_IN_ADDR);
-volatile uint8_t usbEP1Out[USB_EP1_OUT_LEN] __at(USB_EP1_OUT_ADDR);
+typedef struct
+{
+	/* The endpoints and comms interface the port is bound to, and its packet buffers */
+	uint8_t dataEP;
+	uint8_t notifyEP;
+	uint8_t commIface;
+	volatile usbCDCPortRAM_t *ram;
+	/* The policy for writes while DTR is low, which carries over a reconfiguration */
+	uint8_t dtrPolicy;
 
-void usbCDCInit()
+	usbLineCoding_t lineCoding;
+	/* The receive ring, which the interrupt fills behind the main loop's reads */
+	volatile uint8_t recvLen[USB_CDC_OUT_SLOTS];
+	volatile uint8_t recvSlot, recvFull;
+	uint8_t readCounter;
+	/* How much of a line usbUARTReadUntil() has already copied out and consumed */
+	uint16_t recvScanLen;
+
+	/*
+	 * The send queue is a single-producer, single-consumer ring: the main loop only ever
+	 * advances sendFIFOHead and the IN side of the data endpoint only ever advances sendFIFOTail.
+	 * Both are free-running so head - tail is always the number of queued sends.
+	 * sendFIFODone follows the tail as sends complete, and entries are not reused until done with.
+	 */
+	volatile sendFIFOEntry_t sendFIFO[USB_CDC_SEND_QUEUE_LEN];
+	volatile uint8_t sendFIFOHead, sendFIFOTail, sendFIFODone;
+	void (*sentFunc)();
+
+	/*
+	 * The transmit stream packs writes into the IN packet slots. txSlotHead is the slot being filled,
+	 * holding txFillLen bytes, and txSlotTail the oldest slot still waiting to go out. txDeadline counts
+	 * down the frames left before a part filled slot is sent, and txBusy keeps that flush out of the
+	 * stream and send queue while the main loop is working on them. The flush commits from the
+	 * interrupt, so every one of these can change underneath the main loop when txBusy is clear.
+	 */
+	volatile uint8_t txSlotHead, txFillLen;
+	volatile uint8_t txSlotTail, txDeadline;
+	volatile bool txBusy;
+	/* How many short in-place sends were packed into each slot, each owed a sent callback when it goes */
+	volatile uint8_t txSlotSent[USB_CDC_IN_SLOTS];
+
+	/*
+	 * The line state to report in the next SERIAL_STATE notification, event bits accumulating
+	 * until sent, and whether it has changed since the last one went out.
+	 */
+	uint8_t serialState;
+	bool serialStateChanged;
+
+	/*
+	 * The DTR and RTS state the host last set, and the ring the keep policy holds
+	 * the newest keepLen bytes in, the oldest being at keepHead.
+	 */
+	volatile uint8_t controlLines;
+	uint8_t keepRing[USB_CDC_KEEP_LEN];
+	uint8_t keepHead, keepLen;
+} usbCDCPort_t;
+
+/* Define the ports' packet buffers */
+volatile usbCDCPortRAM_t usbCDCRAM[USB_CDC_PORTS] __at(USB_CDC_RAM_ADDR);
+
+/* Binds port n to its endpoints, interface and buffers, leaving the rest to usbCDCPortInit() */
+#define USB_CDC_PORT(n) \
+	{ \
+		USB_EP_CDC_DATA(n), USB_EP_CDC_NOTIFY(n), USB_IFACE_CDC_COMM(n), &usbCDCRAM[n], USB_UART_DTR_SEND, \
+		{ 0, 0, 0, 0 }, { 0 }, 0, 0, 0, 0, \
+		{ { 0, NULL, 0 } }, 0, 0, 0, NULL, \
+		0, 0, 0, 0, false, { 0 }, \
+		0, false, \
+		0, { 0 }, 0, 0 \
+	}
+
+usbCDCPort_t usbCDCPorts[USB_CDC_PORTS] =
+{
+	USB_CDC_PORT(0),
+#if USB_CDC_PORTS > 1
+	USB_CDC_PORT(1),
+#endif
+#if USB_CDC_PORTS > 2
+	USB_CDC_PORT(2)
+#endif
+};
+
+/* SET_LINE_CODING lands here, for the port the request was addressed to */
+usbLineCoding_t usbCDCCtrlBuffer;
+usbCDCPort_t *usbCDCCtrlPort;
+
+/*
+ * Hands free receive ring slots to the SIE in ring order until both of the
+ * port's OUT ping-pong buffer descriptors are armed or the ring is full.
+ */
+void usbCDCArmOut(usbCDCPort_t *port)
 {
-	volatile usbBDTEntry_t *ep1BD;
+	usbServiceEPArmSlots(port->dataEP, (volatile uint8_t *)port->ram->out, USB_CDC_OUT_SLOTS - 1,
+		port->recvSlot + port->recvFull, USB_CDC_OUT_SLOTS - port->recvFull);
+}
 
-	usbCDCLineCoding.baudRate = 11250;
-	usbCDCLineCoding.format = 0;
-	usbCDCLineCoding.parityType = 0;
-	usbCDCLineCoding.dataBits = 8;
+void usbHandleDataEPIn(void *context);
+void usbHandleDataEPOut(void *context);
+void usbHandleNotifyEPIn(void *context);
+void usbCDCSendDone();
+void usbCDCNotify(usbCDCPort_t *port);
+#ifdef USB_CDC_UART_BRIDGE
+void usbCDCBridgeConfigure();
+#endif
 
-	readCounter = 0;
-	dataFullness = 0;
-	sendFIFOCount = 0;
-	usbStatusInEP[1].xferCount = 0;
-	usbStatusInEP[1].epLen = USB_EP1_IN_LEN;
-	usbStatusOutEP[1].xferCount = 64 - dataFullness;
-	usbStatusOutEP[1].epLen = USB_EP1_OUT_LEN;
+void usbCDCPortInit(usbCDCPort_t *port)
+{
+	uint8_t ep = port->dataEP, i;
 
-	ep1BD = &usbBDT[usbStatusOutEP[1].ep.value];
-	ep1BD->count = USB_EP1_OUT_LEN;
-	ep1BD->address = USB_EP1_OUT_ADDR;
-	ep1BD->status.value = 0;
-	ep1BD->status.dataToggleSync = 0;
-	ep1BD->status.dataToggleSyncEn = 1;
-	ep1BD->status.usbOwned = 1;
+	port->lineCoding.baudRate = 11250;
+	port->lineCoding.format = 0;
+	port->lineCoding.parityType = 0;
+	port->lineCoding.dataBits = 8;
 
-	usbStatusInEP[1].ep.buff = 1;
-	ep1BD = &usbBDT[usbStatusInEP[1].ep.value];
-	ep1BD->status.value = 0;
-	ep1BD->status.dataToggleSync = 1;
-	ep1BD->status.dataToggleSyncEn = 1;
-	usbStatusInEP[1].ep.buff = 0;
+	port->sendFIFOHead = 0;
+	port->sendFIFOTail = 0;
+	port->sendFIFODone = 0;
+	port->txSlotHead = 0;
+	port->txSlotTail = 0;
+	port->txFillLen = 0;
+	port->txBusy = false;
+	for (i = 0; i < USB_CDC_IN_SLOTS; ++i)
+		port->txSlotSent[i] = 0;
+	/* No terminal is open until the host says so */
+	port->controlLines = 0;
+	port->keepHead = 0;
+	port->keepLen = 0;
+	usbStatusInEP[ep].xferCount = 0;
 
-	//uartInit();
+	/* Empty the receive ring and give the SIE its first two slots, the first packet in being DATA0 */
+	port->recvSlot = 0;
+	port->recvFull = 0;
+	port->readCounter = 0;
+	port->recvScanLen = 0;
+	usbStatusOutEP[ep].dataToggle = 0;
+	usbStatusOutEP[ep].armedCount = 0;
+	usbCDCArmOut(port);
+
+	/* Everything the data endpoint sends is already in USB RAM, and the first packet out is DATA0 */
+	usbStatusInEP[ep].buffAddr = ptrToAddr(port->ram->in);
+	usbStatusInEP[ep].dataToggle = 0;
+	usbStatusInEP[ep].xferEnds = 0;
+	usbStatusInEP[ep].armedCount = 0;
+	usbStatusInEP[ep].func = usbCDCSendDone;
+
+	usbRegisterEPHandler(ep, USB_DIR_OUT, usbHandleDataEPOut, port);
+	usbRegisterEPHandler(ep, USB_DIR_IN, usbHandleDataEPIn, port);
+
+	/* Line levels carry over a reconfiguration but events do not, and the host learns the levels afresh */
+	port->serialState &= USB_UART_STATE_DCD | USB_UART_STATE_DSR;
+	port->serialStateChanged = port->serialState != 0;
+	usbStatusInEP[port->notifyEP].buffAddr = ptrToAddr(&port->ram->notification);
+	usbRegisterEPHandler(port->notifyEP, USB_DIR_IN, usbHandleNotifyEPIn, port);
+	usbCDCNotify(port);
+}
+
+void usbCDCInit()
+{
+	uint8_t i;
+	for (i = 0; i < USB_CDC_PORTS; ++i)
+		usbCDCPortInit(&usbCDCPorts[i]);
+#ifdef USB_CDC_UART_BRIDGE
+	usbCDCBridgeConfigure();
+#endif
 }
 
 void usbRequestSetLineCoding()
 {
-	usbLineCoding_t *lineCoding = (usbLineCoding_t *)usbCDCCtrlBuffer;
-	usbCDCLineCoding.baudRate = lineCoding->baudRate;
+	usbCDCCtrlPort->lineCoding.baudRate = usbCDCCtrlBuffer.baudRate;
+	usbCDCCtrlPort->lineCoding.format = usbCDCCtrlBuffer.format;
+	usbCDCCtrlPort->lineCoding.parityType = usbCDCCtrlBuffer.parityType;
+	usbCDCCtrlPort->lineCoding.dataBits = usbCDCCtrlBuffer.dataBits;
+#ifdef USB_CDC_UART_BRIDGE
+	if (usbCDCCtrlPort == &usbCDCPorts[USB_CDC_BRIDGE_PORT])
+		usbCDCBridgeConfigure();
+#endif
 }
 
 void usbHandleCDCRequest(volatile usbBDTEntry_t *BD)
 {
 	volatile usbSetupPacket_t *packet = addrToPtr(BD->address);
-	if (packet->requestType.type != USB_REQUEST_TYPE_CLASS)
+	usbCDCPort_t *port;
+	/*
+	 * Class requests are addressed to a port's comms interface, whose number is twice the port's.
+	 * Anything else is left unanswered, which stalls it.
+	 */
+	if (packet->requestType.type != USB_REQUEST_TYPE_CLASS ||
+		packet->requestType.recipient != USB_RECIPIENT_INTERFACE || (packet->index.value >> 1) >= USB_CDC_PORTS)
 		return;
+	port = &usbCDCPorts[packet->index.value >> 1];
 
 	switch (packet->request)
 	{
@@ -111,8 +296,9 @@ void usbHandleCDCRequest(volatile usbBDTEntry_t *BD)
 	USB_REQUEST_CLEAR_COMM_FEATURE = 0x04
 		 */
 		case USB_REQUEST_SET_LINE_CODING:
+			usbCDCCtrlPort = port;
 			usbStatusOutEP[0].buffSrc = USB_BUFFER_SRC_MEM;
-			usbStatusOutEP[0].buffer.memPtr = usbCDCCtrlBuffer;
+			usbStatusOutEP[0].buffer.memPtr = &usbCDCCtrlBuffer;
 			usbStatusOutEP[0].xferCount = sizeof(usbLineCoding_t);
 			usbStatusOutEP[0].func = usbRequestSetLineCoding;
 			usbStatusOutEP[0].needsArming = 1;
@@ -120,11 +306,13 @@ void usbHandleCDCRequest(volatile usbBDTEntry_t *BD)
 		case USB_REQUEST_GET_LINE_CODING:
 			/* Returns the current Line Coding configuration */
 			usbStatusInEP[0].buffSrc = USB_BUFFER_SRC_MEM;
-			usbStatusInEP[0].buffer.memPtr = &usbCDCLineCoding;
+			usbStatusInEP[0].buffer.memPtr = &port->lineCoding;
 			usbStatusInEP[0].xferCount = sizeof(usbLineCoding_t);
 			usbStatusInEP[0].needsArming = 1;
 			break;
 		case USB_REQUEST_SET_CONTROL_LINE:
+			/* Held output is sent on by the next write or SOF once DTR is high */
+			port->controlLines = packet->value.value & (USB_UART_LINE_DTR | USB_UART_LINE_RTS);
 			/* Generate a reply that is 0 bytes long to acknowledge */
 			usbStatusInEP[0].needsArming = 1;
 			break;
@@ -135,172 +323,920 @@ void usbHandleCDCRequest(volatile usbBDTEntry_t *BD)
 	}
 }
 
-void usbHandleDataEPIn()
+/*
+ * Takes the send at the tail of the queue and makes it the data endpoint's current IN transfer.
+ * Returns false if there was nothing queued.
+ */
+bool usbCDCNextSend(void *context)
 {
-	volatile usbBDTEntry_t *ep1BD;
+	usbCDCPort_t *port = context;
+	volatile sendFIFOEntry_t *entry;
+	if (port->sendFIFOTail == port->sendFIFOHead)
+		return false;
+	entry = &port->sendFIFO[port->sendFIFOTail & (USB_CDC_SEND_QUEUE_LEN - 1)];
+	usbServiceEPStartIn(port->dataEP, entry->data, entry->len);
+	++port->sendFIFOTail;
+	return true;
+}
+
+/*
+ * Keeps both of the data endpoint's IN buffer descriptors filled and armed for as long as
+ * there is data queued, moving on to the next queued send as each completes staging.
+ * A ZLP owed when the queue runs dry waits for the next SOF, so that a writer filling
+ * slot after slot has them go out as one transfer.
+ */
+void usbCDCQueueIn(usbCDCPort_t *port)
+{
+	usbServiceEPQueueIn(port->dataEP, usbCDCNextSend, port, false);
+}
 
-	// If there is nothing to transfer or a transfer is already in progress, don't do anything.
-	if (usbStatusInEP[1].xferCount == 0)
+void usbHandleDataEPIn(void *context)
+{
+	usbCDCQueueIn(context);
+}
+
+/*
+ * Sends the line state as a SERIAL_STATE notification if it has changed and the last
+ * notification has gone. Only one is ever in flight, which coalesces changes made meanwhile.
+ */
+void usbCDCNotify(usbCDCPort_t *port)
+{
+	volatile usbCDCNotification_t *notification = &port->ram->notification;
+	usbEPStatus_t *epStatus = &usbStatusInEP[port->notifyEP];
+
+	if (!port->serialStateChanged || usbActiveConfig == 0 || epStatus->armedCount != 0)
+		return;
+
+	notification->requestType = USB_CDC_NOTIFY_REQUEST_TYPE;
+	notification->notification = USB_CDC_NOTIFY_SERIAL_STATE;
+	notification->value = 0;
+	notification->index = port->commIface;
+	notification->length = sizeof(notification->data);
+	notification->data = port->serialState;
+	port->serialState &= USB_UART_STATE_DCD | USB_UART_STATE_DSR;
+	port->serialStateChanged = false;
+
+	epStatus->buffSrc = USB_BUFFER_SRC_USB_RAM;
+	epStatus->buffer.memPtr = (void *)notification;
+	epStatus->xferCount = sizeof(usbCDCNotification_t);
+	epStatus->func = NULL;
+	usbServiceEPWriteQueue(port->notifyEP);
+}
+
+void usbHandleNotifyEPIn(void *context)
+{
+	usbCDCNotify(context);
+}
+
+/*
+ * Runs as each send on a data endpoint completes, which happens in queue order. Stream slots go back
+ * to the transmit stream, while the application hears about its own buffers through the sent callback.
+ * Completion callbacks take no arguments, but usbPacket still holds the endpoint the send went out on,
+ * and the port is the context its IN handler was registered with.
+ */
+void usbCDCSendDone()
+{
+	usbCDCPort_t *port = usbStatusInEP[usbPacket.epNum].context;
+	volatile sendFIFOEntry_t *entry = &port->sendFIFO[port->sendFIFODone & (USB_CDC_SEND_QUEUE_LEN - 1)];
+	uint8_t slot, sent = 1;
+	if (entry->source == USB_CDC_SRC_STREAM)
 	{
-		--sendFIFOCount;
-		if (usbUARTDataSent())
-			return;
+		/* The slot may be written again as soon as it is handed back, so take its count first */
+		slot = port->txSlotTail & (USB_CDC_IN_SLOTS - 1);
+		sent = port->txSlotSent[slot];
+		port->txSlotSent[slot] = 0;
+		++port->txSlotTail;
 	}
+	++port->sendFIFODone;
+	if (port->sentFunc != NULL)
+	{
+		for (; sent != 0; --sent)
+			port->sentFunc();
+	}
+}
+
+void usbHandleDataEPOut(void *context)
+{
+	usbCDCPort_t *port = context;
+	/* Packets complete in the order their slots were armed, so this one fills the slot after the last full one */
+	uint8_t slot = (port->recvSlot + port->recvFull) & (USB_CDC_OUT_SLOTS - 1);
+	port->recvLen[slot] = usbBDT[usbPacket.value].count;
+	++port->recvFull;
+	--usbStatusOutEP[port->dataEP].armedCount;
 
-	ep1BD = &usbBDT[usbStatusInEP[1].ep.value];
-	ep1BD->address = USB_EP1_IN_ADDR;
-	usbServiceEPWriteArm(ep1BD, 1);
+	usbCDCArmOut(port);
+#ifdef USB_CDC_UART_BRIDGE
+	/* Start the UART draining the receive ring if it had run dry */
+	if (port == &usbCDCPorts[USB_CDC_BRIDGE_PORT])
+		PIE1bits.TX1IE = 1;
+#endif
 }
 
-void usbHandleDataEPOut()
+/*
+ * Returns the queue slot the next send should be written to, or NULL if the queue is full.
+ */
+volatile sendFIFOEntry_t *usbCDCSendSlot(usbCDCPort_t *port)
 {
-	volatile usbBDTEntry_t *ep1BD = &usbBDT[usbPacket.value];
-	bool lastDTS = usbBDT[usbPacket.value].status.dataToggleSync;
-	uint8_t readCount = ep1BD->count;
-	if (readCount > usbStatusOutEP[1].xferCount)
-		readCount = usbStatusOutEP[1].xferCount;
-	dataFullness += readCount;
+	if ((uint8_t)(port->sendFIFOHead - port->sendFIFODone) == USB_CDC_SEND_QUEUE_LEN)
+		return NULL;
+	return &port->sendFIFO[port->sendFIFOHead & (USB_CDC_SEND_QUEUE_LEN - 1)];
+}
 
-	//uartIRQ();
-	if (dataFullness == readCounter)
+/*
+ * Publishes the slot filled in after usbCDCSendSlot(). If the data endpoint was idle, nothing
+ * will come along to pick the send up, so start it going ourselves.
+ */
+void usbCDCSendCommit(usbCDCPort_t *port)
+{
+	bool lockState;
+#ifdef USB_STATS
+	uint8_t depth;
+#endif
+	++port->sendFIFOHead;
+#ifdef USB_STATS
+	depth = port->sendFIFOHead - port->sendFIFODone;
+	if (depth > usbStats.sendHighWater[port->dataEP >> 1])
+		usbStats.sendHighWater[port->dataEP >> 1] = depth;
+#endif
+	if (usbStatusInEP[port->dataEP].armedCount == 0)
 	{
-		readCounter = 0;
-		dataFullness = 0;
+		lockState = usbLock();
+		usbCDCQueueIn(port);
+		usbUnlock(lockState);
 	}
+}
 
-	ep1BD = &usbBDT[usbStatusOutEP[1].ep.value];
-	ep1BD->count = USB_EP1_OUT_LEN - dataFullness;
-	ep1BD->address = USB_EP1_OUT_ADDR + dataFullness;
-	ep1BD->status.value = 0;
-	if (lastDTS)
-		ep1BD->status.dataToggleSync = 0;
-	else
-		ep1BD->status.dataToggleSync = 1;
-	ep1BD->status.dataToggleSyncEn = 0;
-	ep1BD->status.usbOwned = 1;
+/*
+ * Queues the transmit stream's part or wholly filled slot to go out.
+ * Returns false, leaving the slot be, if the send queue is full.
+ */
+bool usbCDCStreamCommit(usbCDCPort_t *port)
+{
+	volatile sendFIFOEntry_t *entry = usbCDCSendSlot(port);
+	if (entry == NULL)
+		return false;
+	entry->source = USB_CDC_SRC_STREAM;
+	entry->data = (uint8_t *)port->ram->in[port->txSlotHead & (USB_CDC_IN_SLOTS - 1)];
+	entry->len = port->txFillLen;
+	++port->txSlotHead;
+	port->txFillLen = 0;
+	usbCDCSendCommit(port);
+	return true;
 }
 
-void usbServiceCDCDataEP()
+/*
+ * Checks the transmit stream's slots and the send queue have the room for len more bytes.
+ */
+bool usbCDCStreamFits(usbCDCPort_t *port, uint16_t len)
 {
-	if (usbPacket.epNum != 1)
-		return;
-	if (usbPacket.dir == USB_DIR_OUT)
-		usbHandleDataEPOut();
+	uint16_t room = (uint16_t)(USB_CDC_IN_SLOTS - (uint8_t)(port->txSlotHead - port->txSlotTail)) *
+		USB_CDC_DATA_LEN - port->txFillLen;
+	return len <= room && (port->txFillLen + len) / USB_CDC_DATA_LEN <=
+		USB_CDC_SEND_QUEUE_LEN - (uint8_t)(port->sendFIFOHead - port->sendFIFODone);
+}
+
+/*
+ * Copies len bytes into the transmit stream, queueing each slot as it fills.
+ * The caller must hold txBusy and have checked the bytes fit.
+ */
+void usbCDCStreamCopy(usbCDCPort_t *port, const uint8_t source, const uint8_t *data, uint16_t len)
+{
+	volatile uint8_t *dst;
+	uint8_t count;
+
+	while (len != 0)
+	{
+		/* The flush deadline runs from the first byte into a slot */
+		if (port->txFillLen == 0)
+			port->txDeadline = USB_CDC_FLUSH_FRAMES;
+		count = USB_CDC_DATA_LEN - port->txFillLen;
+		if (count > len)
+			count = len;
+		dst = port->ram->in[port->txSlotHead & (USB_CDC_IN_SLOTS - 1)] + port->txFillLen;
+		if (source == USB_BUFFER_SRC_FLASH)
+			usbCopyFromFlash(dst, data, count);
+		else
+			usbCopyFromMem(dst, data, count);
+		data += count;
+		len -= count;
+		port->txFillLen += count;
+		if (port->txFillLen == USB_CDC_DATA_LEN)
+			usbCDCStreamCommit(port);
+	}
+}
+
+/*
+ * Holds a byte written while DTR is low in the keep ring, pushing out the oldest if it is full.
+ */
+void usbCDCKeepPut(usbCDCPort_t *port, const char c)
+{
+	port->keepRing[(port->keepHead + port->keepLen) & (USB_CDC_KEEP_LEN - 1)] = c;
+	if (port->keepLen == USB_CDC_KEEP_LEN)
+		port->keepHead = (port->keepHead + 1) & (USB_CDC_KEEP_LEN - 1);
 	else
-		usbHandleDataEPIn();
+		++port->keepLen;
 }
 
-void usbUARTSendStringF(const char *str)
+/*
+ * Checks whether writes are held back by the DTR low policy, which is never the case with USB_UART_DTR_SEND.
+ */
+bool usbCDCGated(usbCDCPort_t *port)
 {
-	uint16_t i = 0;
-	while (str[i] != 0)
-		++i;
-	if (sendFIFOCount == 0)
+	return !(port->controlLines & USB_UART_LINE_DTR) && port->dtrPolicy != USB_UART_DTR_SEND;
+}
+
+/*
+ * Applies the DTR low policy to a write of len bytes from source, returning whether it counts as sent.
+ */
+bool usbCDCHoldWrite(usbCDCPort_t *port, const uint8_t source, const uint8_t *data, uint16_t len)
+{
+	uint8_t tail, span;
+	if (port->dtrPolicy == USB_UART_DTR_BLOCK)
+		return false;
+	if (port->dtrPolicy == USB_UART_DTR_KEEP)
 	{
-		volatile usbBDTEntry_t *ep1BD = &usbBDT[usbStatusInEP[1].ep.value];
-		usbStatusInEP[1].buffSrc = USB_BUFFER_SRC_FLASH;
-		usbStatusInEP[1].buffer.flashPtr = str;
-		usbStatusInEP[1].xferCount = i;
-		ep1BD->address = USB_EP1_IN_ADDR;
-		usbServiceEPWriteArm(ep1BD, 1);
+		/* Bytes that would only be pushed straight back out are never copied in */
+		if (len > USB_CDC_KEEP_LEN)
+		{
+			data += len - USB_CDC_KEEP_LEN;
+			len = USB_CDC_KEEP_LEN;
+		}
+		/* Push out the oldest bytes to make room, then copy in around the end of the ring */
+		if (port->keepLen + len > USB_CDC_KEEP_LEN)
+		{
+			port->keepHead = (port->keepHead + port->keepLen + len - USB_CDC_KEEP_LEN) & (USB_CDC_KEEP_LEN - 1);
+			port->keepLen = USB_CDC_KEEP_LEN - len;
+		}
+		while (len != 0)
+		{
+			tail = (port->keepHead + port->keepLen) & (USB_CDC_KEEP_LEN - 1);
+			span = USB_CDC_KEEP_LEN - tail;
+			if (span > len)
+				span = len;
+			if (source == USB_BUFFER_SRC_FLASH)
+				usbCopyFromFlash(port->keepRing + tail, data, span);
+			else
+				usbCopyFromMem(port->keepRing + tail, data, span);
+			data += span;
+			len -= span;
+			port->keepLen += span;
+		}
 	}
+	return true;
+}
+
+/*
+ * Moves anything the keep policy held on to into the transmit stream ahead of newer writes,
+ * returning false if it does not fit yet. The caller must hold txBusy or be the SOF flush.
+ */
+bool usbCDCKeepFlushed(usbCDCPort_t *port)
+{
+	uint8_t span;
+
+	if (port->keepLen == 0)
+		return true;
+	if (!usbCDCStreamFits(port, port->keepLen))
+		return false;
+	span = USB_CDC_KEEP_LEN - port->keepHead;
+	if (span > port->keepLen)
+		span = port->keepLen;
+	usbCDCStreamCopy(port, USB_BUFFER_SRC_MEM, port->keepRing + port->keepHead, span);
+	usbCDCStreamCopy(port, USB_BUFFER_SRC_MEM, port->keepRing, port->keepLen - span);
+	port->keepHead = 0;
+	port->keepLen = 0;
+	return true;
+}
+
+/*
+ * Writes len bytes to the transmit stream whole, or not at all if there is not the room for it.
+ */
+bool usbCDCStreamWrite(usbCDCPort_t *port, const uint8_t source, const uint8_t *data, uint16_t len)
+{
+	bool fits;
+	port->txBusy = true;
+	if (usbCDCGated(port))
+		fits = usbCDCHoldWrite(port, source, data, len);
 	else
 	{
-		uint8_t idx = sendFIFOCount - 1;
-		sendFIFO[idx].source = USB_BUFFER_SRC_FLASH;
-		sendFIFO[idx].data.flash = str;
-		sendFIFO[idx].len = i;
+		fits = usbCDCKeepFlushed(port) && usbCDCStreamFits(port, len);
+		if (fits)
+			usbCDCStreamCopy(port, source, data, len);
+	}
+	port->txBusy = false;
+	return fits;
+}
+
+/*
+ * Puts a single byte into the transmit stream, returning false if there is no slot free for it.
+ * The caller must hold txBusy.
+ */
+bool usbCDCStreamPut(usbCDCPort_t *port, const char c)
+{
+	if (usbCDCGated(port))
+	{
+		if (port->dtrPolicy == USB_UART_DTR_KEEP)
+			usbCDCKeepPut(port, c);
+		return port->dtrPolicy != USB_UART_DTR_BLOCK;
+	}
+	if (!usbCDCKeepFlushed(port))
+		return false;
+	/* A slot left full by a commit that found the send queue full has to go first */
+	if (port->txFillLen == USB_CDC_DATA_LEN && !usbCDCStreamCommit(port))
+		return false;
+	if (port->txFillLen == 0)
+	{
+		if ((uint8_t)(port->txSlotHead - port->txSlotTail) == USB_CDC_IN_SLOTS)
+			return false;
+		port->txDeadline = USB_CDC_FLUSH_FRAMES;
+	}
+	port->ram->in[port->txSlotHead & (USB_CDC_IN_SLOTS - 1)][port->txFillLen++] = c;
+	if (port->txFillLen == USB_CDC_DATA_LEN)
+		usbCDCStreamCommit(port);
+	return true;
+}
+
+/*
+ * Renders value into the transmit stream in base, padded out to width with pad. A non-zero
+ * point puts a decimal point that many digits from the right for fixed-point values.
+ */
+bool usbCDCStreamPutNumber(usbCDCPort_t *port, uint32_t value, const bool negative, const uint8_t base,
+	const char hexBase, uint8_t width, const char pad, const uint8_t point)
+{
+	char digits[10];
+	uint8_t count = 0, digit, len;
+
+	do
+	{
+		/* Most values fit in 16 bits, where the division is far cheaper */
+		if (value <= 0xFFFF)
+		{
+			digit = (uint16_t)value % base;
+			value = (uint16_t)value / base;
+		}
+		else
+		{
+			digit = value % base;
+			value /= base;
+		}
+		if (digit >= 10)
+			digits[count++] = hexBase + digit - 10;
+		else
+			digits[count++] = '0' + digit;
+	}
+	while (value != 0 || count <= point);
+
+	len = count + negative + (point != 0);
+	if (negative && pad == '0' && !usbCDCStreamPut(port, '-'))
+		return false;
+	for (; width > len; --width)
+	{
+		if (!usbCDCStreamPut(port, pad))
+			return false;
 	}
-	++sendFIFOCount;
+	if (negative && pad != '0' && !usbCDCStreamPut(port, '-'))
+		return false;
+	while (count != 0)
+	{
+		--count;
+		if (!usbCDCStreamPut(port, digits[count]))
+			return false;
+		if (point != 0 && count == point && !usbCDCStreamPut(port, '.'))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Called once a frame to send a port's part filled slot once it has waited out its flush deadline.
+ */
+void usbCDCPortServiceSOF(usbCDCPort_t *port)
+{
+	if (port->txBusy)
+		return;
+	/* Don't leave held output waiting on the next write once a terminal opens */
+	if (port->keepLen != 0 && !usbCDCGated(port))
+		usbCDCKeepFlushed(port);
+	if (port->txFillLen == 0)
+	{
+		/* The stream has gone quiet for a frame after a send that ended on a packet boundary, so end it */
+		if (port->sendFIFOTail == port->sendFIFOHead)
+			usbServiceEPWriteQueue(port->dataEP);
+		return;
+	}
+	if (port->txDeadline != 0 && --port->txDeadline != 0)
+		return;
+	/* If the send queue is full this is simply tried again next frame */
+	usbCDCStreamCommit(port);
+}
+
+void usbCDCServiceSOF()
+{
+	uint8_t i;
+	if (usbActiveConfig == 0)
+		return;
+	for (i = 0; i < USB_CDC_PORTS; ++i)
+		usbCDCPortServiceSOF(&usbCDCPorts[i]);
+}
+
+bool usbUARTSendStringF(const uint8_t portNum, const char *str)
+{
+	uint16_t i = 0;
+	while (str[i] != 0)
+		++i;
+	return usbCDCStreamWrite(&usbCDCPorts[portNum], USB_BUFFER_SRC_FLASH, (const uint8_t *)str, i);
 }
 
-void usbUARTSendStringM(char *str)
+bool usbUARTSendStringM(const uint8_t portNum, char *str)
 {
 	uint16_t i = 0;
 	while (str[i] != 0)
 		++i;
-	if (sendFIFOCount == 0)
+	return usbCDCStreamWrite(&usbCDCPorts[portNum], USB_BUFFER_SRC_MEM, (const uint8_t *)str, i);
+}
+
+bool usbUARTSendChar(const uint8_t portNum, const char c)
+{
+	return usbCDCStreamWrite(&usbCDCPorts[portNum], USB_BUFFER_SRC_MEM, (const uint8_t *)&c, 1);
+}
+
+bool usbUARTSendBuffer(const uint8_t portNum, uint8_t *buffer, uint16_t len)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	volatile sendFIFOEntry_t *entry;
+	bool queued = false;
+
+	if (len == 0)
+		return true;
+	/*
+	 * Buffers in USB RAM are sent in place, anything else is copied into the transmit stream,
+	 * as is everything while the DTR policy holds writes back so it applies and the buffer is free straight away.
+	 */
+	if (!usbIsUSBRAM(buffer) || usbCDCGated(port))
+		return usbCDCStreamWrite(port, USB_BUFFER_SRC_MEM, buffer, len);
+
+	port->txBusy = true;
+	/*
+	 * A buffer shorter than a packet would end the stream's transfer and its own with short packets,
+	 * so it is packed into the stream like any other write, its sent callback following the slot
+	 * its last byte lands in. That slot is not queued yet, so the count is safe to bump ahead of the copy.
+	 */
+	if (len < USB_CDC_DATA_LEN)
 	{
-		volatile usbBDTEntry_t *ep1BD = &usbBDT[usbStatusInEP[1].ep.value];
-		usbStatusInEP[1].buffSrc = USB_BUFFER_SRC_MEM;
-		usbStatusInEP[1].buffer.memPtr = str;
-		usbStatusInEP[1].xferCount = i;
-		ep1BD->address = USB_EP1_IN_ADDR;
-		usbServiceEPWriteArm(ep1BD, 1);
+		queued = usbCDCKeepFlushed(port) && usbCDCStreamFits(port, len);
+		if (queued)
+		{
+			++port->txSlotSent[(port->txSlotHead + (port->txFillLen + len - 1) / USB_CDC_DATA_LEN) &
+				(USB_CDC_IN_SLOTS - 1)];
+			usbCDCStreamCopy(port, USB_BUFFER_SRC_MEM, buffer, len);
+		}
+		port->txBusy = false;
+		return queued;
 	}
-	else
+	/* Whatever is already in the stream has to go out ahead of the buffer */
+	if (usbCDCKeepFlushed(port) && (port->txFillLen == 0 || usbCDCStreamCommit(port)))
 	{
-		uint8_t idx = sendFIFOCount - 1;
-		sendFIFO[idx].source = USB_BUFFER_SRC_MEM;
-		sendFIFO[idx].data.mem = str;
-		sendFIFO[idx].len = i;
+		entry = usbCDCSendSlot(port);
+		if (entry != NULL)
+		{
+			entry->source = USB_BUFFER_SRC_USB_RAM;
+			entry->data = buffer;
+			entry->len = len;
+			usbCDCSendCommit(port);
+			queued = true;
+		}
 	}
-	++sendFIFOCount;
+	port->txBusy = false;
+	return queued;
 }
 
-void usbUARTSendChar(const char c)
+bool usbUARTSendSegments(const uint8_t portNum, const usbSegment_t *segments, uint8_t count)
 {
-	if (sendFIFOCount == 0)
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	uint16_t total = 0;
+	uint8_t i;
+	bool fits;
+
+	for (i = 0; i < count; ++i)
+		total += segments[i].len;
+	port->txBusy = true;
+	if (usbCDCGated(port))
 	{
-		volatile usbBDTEntry_t *ep1BD = &usbBDT[usbStatusInEP[1].ep.value];
-		usbStatusInEP[1].buffSrc = USB_BUFFER_SRC_MEM;
-		usbStatusInEP[1].buffer.memPtr = &c;
-		usbStatusInEP[1].xferCount = 1;
-		ep1BD->address = USB_EP1_IN_ADDR;
-		usbServiceEPWriteArm(ep1BD, 1);
+		fits = port->dtrPolicy != USB_UART_DTR_BLOCK;
+		for (i = 0; fits && i < count; ++i)
+			usbCDCHoldWrite(port, segments[i].source, segments[i].data, segments[i].len);
 	}
 	else
 	{
-		uint8_t idx = sendFIFOCount - 1;
-		sendFIFO[idx].source = USB_BUFFER_SRC_CHAR;
-		sendFIFO[idx].data.ch = c;
-		sendFIFO[idx].len = 1;
+		fits = usbCDCKeepFlushed(port) && usbCDCStreamFits(port, total);
+		for (i = 0; fits && i < count; ++i)
+			usbCDCStreamCopy(port, segments[i].source, segments[i].data, segments[i].len);
 	}
-	++sendFIFOCount;
+	port->txBusy = false;
+	return fits;
 }
 
-bool usbUARTDataSent()
+bool usbUARTPrintf(const uint8_t portNum, const char *format, ...)
 {
-	if (sendFIFOCount != 0)
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	va_list args;
+	const char *str;
+	uint32_t value;
+	long number;
+	uint8_t width, point;
+	char c, pad;
+	bool ok = true, isLong;
+
+	/* Don't bother formatting anything that is only going to be thrown away or refused */
+	if (usbCDCGated(port) && port->dtrPolicy != USB_UART_DTR_KEEP)
+		return port->dtrPolicy == USB_UART_DTR_DROP;
+
+	va_start(args, format);
+	port->txBusy = true;
+	while (ok && (c = *format++) != 0)
 	{
-		uint8_t i, fifoCount;
-		usbStatusInEP[1].buffSrc = sendFIFO[0].source;
-		if (sendFIFO[0].source == USB_BUFFER_SRC_MEM)
-			usbStatusInEP[1].buffer.memPtr = sendFIFO[0].data.mem;
-		else if (sendFIFO[0].source == USB_BUFFER_SRC_FLASH)
-			usbStatusInEP[1].buffer.flashPtr = sendFIFO[0].data.flash;
-		else
+		if (c != '%')
 		{
-			usbStatusInEP[1].buffSrc = USB_BUFFER_SRC_MEM;
-			usbStatusInEP[1].buffer.memPtr = &sendChar;
-			sendChar = sendFIFO[0].data.ch;
+			ok = usbCDCStreamPut(port, c);
+			continue;
 		}
-		usbStatusInEP[1].xferCount = sendFIFO[0].len;
 
-		fifoCount = sendFIFOCount - 1;
-		for (i = 0; i < fifoCount; i++)
+		pad = ' ';
+		width = 0;
+		point = 0;
+		isLong = false;
+		c = *format++;
+		if (c == '0')
 		{
-			sendFIFO[i].source = sendFIFO[i + 1].source;
-			if (sendFIFO[i].source == USB_BUFFER_SRC_MEM)
-				sendFIFO[i].data.mem = sendFIFO[i + 1].data.mem;
-			else if (sendFIFO[0].source == USB_BUFFER_SRC_FLASH)
-				sendFIFO[i].data.flash = sendFIFO[i + 1].data.flash;
-			else
-				sendFIFO[i].data.ch = sendFIFO[i + 1].data.ch;
-			sendFIFO[i].len = sendFIFO[i + 1].len;
+			pad = '0';
+			c = *format++;
+		}
+		for (; c >= '0' && c <= '9'; c = *format++)
+			width = width * 10 + c - '0';
+		if (c == '.')
+		{
+			for (c = *format++; c >= '0' && c <= '9'; c = *format++)
+				point = point * 10 + c - '0';
+			/* There is only ever room for 9 digits after the point */
+			if (point > 9)
+				point = 9;
+		}
+		if (c == 'l')
+		{
+			isLong = true;
+			c = *format++;
+		}
+
+		switch (c)
+		{
+			case 'd':
+			case 'i':
+				if (isLong)
+					number = va_arg(args, long);
+				else
+					number = va_arg(args, int);
+				if (number < 0)
+					value = 0 - (uint32_t)number;
+				else
+					value = number;
+				ok = usbCDCStreamPutNumber(port, value, number < 0, 10, 'a', width, pad, point);
+				break;
+			case 'u':
+			case 'x':
+			case 'X':
+				if (isLong)
+					value = va_arg(args, unsigned long);
+				else
+					value = va_arg(args, unsigned int);
+				if (c == 'u')
+					ok = usbCDCStreamPutNumber(port, value, false, 10, 'a', width, pad, point);
+				else
+					ok = usbCDCStreamPutNumber(port, value, false, 16, c - 'X' + 'A', width, pad, point);
+				break;
+			case 'c':
+				ok = usbCDCStreamPut(port, va_arg(args, int));
+				break;
+			case 's':
+				for (str = va_arg(args, const char *); ok && *str != 0; ++str)
+					ok = usbCDCStreamPut(port, *str);
+				break;
+			case 0:
+				/* Leave the format pointing at its terminator */
+				--format;
+				break;
+			default:
+				ok = usbCDCStreamPut(port, c);
 		}
 	}
-	return sendFIFOCount == 0;
+	port->txBusy = false;
+	va_end(args);
+	return ok;
 }
 
-bool usbUARTHaveData()
+void usbUARTSetSentCallback(const uint8_t portNum, void (*func)())
 {
-	return dataFullness != readCounter;
+	bool lockState;
+	lockState = usbLock();
+	usbCDCPorts[portNum].sentFunc = func;
+	usbUnlock(lockState);
 }
 
-char usbUARTRecvChar()
+void usbUARTSetSerialLevels(const uint8_t portNum, uint8_t levels)
 {
-	if (readCounter >= dataFullness)
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	bool lockState;
+	levels &= USB_UART_STATE_DCD | USB_UART_STATE_DSR;
+	lockState = usbLock();
+	if ((port->serialState & (USB_UART_STATE_DCD | USB_UART_STATE_DSR)) != levels)
+	{
+		port->serialState = (port->serialState & ~(USB_UART_STATE_DCD | USB_UART_STATE_DSR)) | levels;
+		port->serialStateChanged = true;
+		usbCDCNotify(port);
+	}
+	usbUnlock(lockState);
+}
+
+void usbUARTSignalSerialEvents(const uint8_t portNum, uint8_t events)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	bool lockState;
+	events &= ~(USB_UART_STATE_DCD | USB_UART_STATE_DSR);
+	if (events == 0)
+		return;
+	lockState = usbLock();
+	port->serialState |= events;
+	port->serialStateChanged = true;
+	usbCDCNotify(port);
+	usbUnlock(lockState);
+}
+
+uint8_t usbUARTControlLines(const uint8_t portNum)
+{
+	return usbCDCPorts[portNum].controlLines;
+}
+
+void usbUARTSetDTRPolicy(const uint8_t portNum, const uint8_t policy)
+{
+	usbCDCPorts[portNum].dtrPolicy = policy;
+}
+
+bool usbUARTDataSent(const uint8_t portNum)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	/* Everything written has been packed, queued and sent */
+	return port->txFillLen == 0 && port->sendFIFODone == port->sendFIFOHead;
+}
+
+/*
+ * Retires any fully read slots at the head of the receive ring and hands them back to the SIE.
+ */
+void usbCDCRecvRelease(usbCDCPort_t *port)
+{
+	bool lockState;
+	if (port->recvFull == 0 || port->readCounter < port->recvLen[port->recvSlot])
+		return;
+	lockState = usbLock();
+	while (port->recvFull != 0 && port->readCounter >= port->recvLen[port->recvSlot])
+	{
+		port->recvSlot = (port->recvSlot + 1) & (USB_CDC_OUT_SLOTS - 1);
+		--port->recvFull;
+		port->readCounter = 0;
+	}
+	usbCDCArmOut(port);
+	usbUnlock(lockState);
+}
+
+bool usbCDCHaveData(usbCDCPort_t *port)
+{
+	usbCDCRecvRelease(port);
+	return port->recvFull != 0;
+}
+
+bool usbUARTHaveData(const uint8_t portNum)
+{
+	return usbCDCHaveData(&usbCDCPorts[portNum]);
+}
+
+char usbUARTRecvChar(const uint8_t portNum)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	char c;
+	if (!usbCDCHaveData(port))
+		return 0;
+	port->recvScanLen = 0;
+	c = port->ram->out[port->recvSlot][port->readCounter++];
+	/* Give the slot back as soon as it is drained rather than on the next call */
+	usbCDCRecvRelease(port);
+	return c;
+}
+
+uint8_t usbUARTPeek(const uint8_t portNum, const uint8_t **data)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	if (!usbCDCHaveData(port))
 		return 0;
-	return usbEP1Out[readCounter++];
+	*data = (const uint8_t *)&port->ram->out[port->recvSlot][port->readCounter];
+	return port->recvLen[port->recvSlot] - port->readCounter;
+}
+
+void usbUARTConsume(const uint8_t portNum, uint8_t count)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	port->recvScanLen = 0;
+	port->readCounter += count;
+	usbCDCRecvRelease(port);
+}
+
+uint16_t usbUARTRead(const uint8_t portNum, uint8_t *buffer, uint16_t len)
+{
+	const uint8_t *data;
+	uint16_t count = 0;
+	uint8_t span;
+
+	while (count < len && (span = usbUARTPeek(portNum, &data)) != 0)
+	{
+		if (span > len - count)
+			span = len - count;
+		usbCopyFromMem(buffer + count, data, span);
+		count += span;
+		usbUARTConsume(portNum, span);
+	}
+	return count;
+}
+
+uint16_t usbUARTReadUntil(const uint8_t portNum, uint8_t *buffer, uint16_t len, const char delim)
+{
+	usbCDCPort_t *port = &usbCDCPorts[portNum];
+	uint16_t count = port->recvScanLen;
+	const uint8_t *data;
+	uint8_t span, i;
+	char c = ~delim;
+
+	/*
+	 * Carry on after whatever the last call copied out. Bytes are consumed as they are copied so each
+	 * packet slot goes straight back to the SIE, as a line longer than the ring would otherwise never complete.
+	 */
+	while (c != delim && count < len && (span = usbUARTPeek(portNum, &data)) != 0)
+	{
+		for (i = 0; i < span && c != delim && count < len; ++i)
+		{
+			c = data[i];
+			buffer[count++] = c;
+		}
+		port->readCounter += i;
+		usbCDCRecvRelease(port);
+	}
+
+	if (c != delim && count < len)
+	{
+		port->recvScanLen = count;
+		return 0;
+	}
+	port->recvScanLen = 0;
+	return count;
+}
+
+#ifdef USB_CDC_UART_BRIDGE
+/*
+ * The UART side of the bridge. The port's receive ring doubles as the UART's transmit ring and its
+ * transmit stream as the UART's receive ring, so bytes move between the UART and USB RAM with no copies in between.
+ * A full receive ring leaves the data OUT endpoint unarmed, so the host is NAKed rather than bytes dropped.
+ * bridgeSevenBit is set for 7 data bit frames, which carry parity, if any, in bit 7,
+ * while bridgeNinthBit is set for 8 data bits with parity, which goes in the EUSART's ninth bit.
+ */
+#define bridgePort	(&usbCDCPorts[USB_CDC_BRIDGE_PORT])
+bool bridgeSevenBit, bridgeNinthBit;
+
+/*
+ * Works out the parity bit to go with data for the line coding's parity type.
+ */
+uint8_t usbCDCBridgeParity(uint8_t data)
+{
+	data ^= data >> 4;
+	data ^= data >> 2;
+	data ^= data >> 1;
+	data &= 1;
+	switch (bridgePort->lineCoding.parityType)
+	{
+		case USB_CDC_PARITY_ODD:
+			return data ^ 1;
+		case USB_CDC_PARITY_EVEN:
+			return data;
+		case USB_CDC_PARITY_MARK:
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Sets EUSART1 up from the full line coding. Frames are always sent with one stop bit, 7 data
+ * bits without parity being padded out with a second, and anything but 7 data bits is taken as 8.
+ */
+void usbCDCBridgeConfigure()
+{
+	usbLineCoding_t *lineCoding = &bridgePort->lineCoding;
+	uint32_t divisor;
+
+	if (lineCoding->baudRate == 0)
+		return;
+	/* With BRG16 and BRGH set the baud rate is Fosc / (4 * (divisor + 1)) */
+	divisor = (USB_CDC_BRIDGE_FOSC / 4 + lineCoding->baudRate / 2) / lineCoding->baudRate;
+	if (divisor != 0)
+		--divisor;
+	if (divisor > 0xFFFF)
+		divisor = 0xFFFF;
+	bridgeSevenBit = lineCoding->dataBits == 7;
+	bridgeNinthBit = !bridgeSevenBit && lineCoding->parityType != USB_CDC_PARITY_NONE;
+
+	RCSTA1bits.SPEN = 0;
+	TXSTA1bits.SYNC = 0;
+	TXSTA1bits.BRGH = 1;
+	BAUDCON1bits.BRG16 = 1;
+	SPBRGH1 = divisor >> 8;
+	SPBRG1 = divisor;
+	TXSTA1bits.TX9 = bridgeNinthBit;
+	RCSTA1bits.RX9 = bridgeNinthBit;
+	TXSTA1bits.TXEN = 1;
+	RCSTA1bits.CREN = 1;
+	RCSTA1bits.SPEN = 1;
+	PIE1bits.RC1IE = 1;
+	PIE1bits.TX1IE = 1;
+}
+
+/*
+ * Feeds the UART the next byte from the receive ring, going quiet when the ring runs dry.
+ */
+void usbCDCBridgeTx()
+{
+	usbCDCPort_t *port = bridgePort;
+	uint8_t data;
+
+	usbCDCRecvRelease(port);
+	if (port->recvFull == 0)
+	{
+		PIE1bits.TX1IE = 0;
+		return;
+	}
+	data = port->ram->out[port->recvSlot][port->readCounter++];
+	if (bridgeSevenBit)
+	{
+		data &= 0x7F;
+		if (port->lineCoding.parityType == USB_CDC_PARITY_NONE)
+			data |= 0x80;
+		else
+			data |= usbCDCBridgeParity(data) << 7;
+	}
+	else if (bridgeNinthBit)
+		TXSTA1bits.TX9D = usbCDCBridgeParity(data);
+	TXREG1 = data;
+	/* Hand the slot back as soon as it is drained so the host can refill it */
+	usbCDCRecvRelease(port);
+}
+
+/*
+ * Moves received bytes into the transmit stream, which the SOF flush deadline batches up
+ * into packets, and reports any line errors and lost bytes through SERIAL_STATE.
+ */
+void usbCDCBridgeRx()
+{
+	usbCDCPort_t *port = bridgePort;
+	uint8_t data, events = 0;
+	bool ninth;
+
+	while (PIR1bits.RC1IF)
+	{
+		/* The error and ninth bits belong to the byte at the head of the FIFO, so read them first */
+		if (RCSTA1bits.FERR)
+			events |= USB_UART_STATE_FRAMING;
+		ninth = RCSTA1bits.RX9D;
+		data = RCREG1;
+		if (bridgeNinthBit && ninth != usbCDCBridgeParity(data))
+			events |= USB_UART_STATE_PARITY;
+		else if (bridgeSevenBit)
+		{
+			if (port->lineCoding.parityType != USB_CDC_PARITY_NONE &&
+				(data >> 7) != usbCDCBridgeParity(data & 0x7F))
+				events |= USB_UART_STATE_PARITY;
+			data &= 0x7F;
+		}
+		if (!usbCDCStreamPut(port, data))
+			events |= USB_UART_STATE_OVERRUN;
+	}
+	/* An overrun stops reception until the receiver is reset */
+	if (RCSTA1bits.OERR)
+	{
+		RCSTA1bits.CREN = 0;
+		RCSTA1bits.CREN = 1;
+		events |= USB_UART_STATE_OVERRUN;
+	}
+	if (events != 0)
+		usbUARTSignalSerialEvents(USB_CDC_BRIDGE_PORT, events);
+}
+
+void usbUARTBridgeIRQ()
+{
+	if (PIR1bits.RC1IF || RCSTA1bits.OERR)
+		usbCDCBridgeRx();
+	if (PIE1bits.TX1IE && PIR1bits.TX1IF)
+		usbCDCBridgeTx();
 }
+#endif
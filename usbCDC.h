@@ -31,6 +31,66 @@ extern "C"
 {
 #endif
 
+/*
+ * Number of CDC ACM ports the device presents, up to 3. Port n is the function made of interfaces
+ * 2n (comms) and 2n + 1 (data), with its data on bulk endpoint 2n + 1 and notifications on endpoint 2n + 2.
+ */
+#ifndef USB_CDC_PORTS
+#define USB_CDC_PORTS			1
+#endif
+#if USB_CDC_PORTS < 1 || USB_CDC_PORTS > 3
+#error "USB_CDC_PORTS must be between 1 and 3"
+#endif
+
+#define USB_IFACE_CDC_COMM(port)	((port) << 1)
+#define USB_IFACE_CDC_DATA(port)	(((port) << 1) + 1)
+#define USB_EP_CDC_DATA(port)		(((port) << 1) + 1)
+#define USB_EP_CDC_NOTIFY(port)		(((port) << 1) + 2)
+
+#define USB_CDC_NOTIFY_LEN		16
+
+/*
+ * Each port receives into a ring of USB_CDC_OUT_SLOTS packet slots and transmits from a ring of
+ * USB_CDC_IN_SLOTS, both powers of two and at least 2 so one slot can be read or filled while the SIE
+ * has the other. The defaults shrink as ports, or the raw interface enabled by USB_RAW_INTERFACE,
+ * are added so everything fits in USB RAM, down to 2 slots of 32 byte packets.
+ */
+#ifndef USB_CDC_DATA_LEN
+#if USB_CDC_PORTS == 1 || (USB_CDC_PORTS == 2 && !defined(USB_RAW_INTERFACE))
+#define USB_CDC_DATA_LEN		64
+#else
+#define USB_CDC_DATA_LEN		32
+#endif
+#endif
+
+#ifndef USB_CDC_OUT_SLOTS
+#if USB_CDC_PORTS == 1 && !defined(USB_RAW_INTERFACE)
+#define USB_CDC_OUT_SLOTS		4
+#else
+#define USB_CDC_OUT_SLOTS		2
+#endif
+#endif
+
+#ifndef USB_CDC_IN_SLOTS
+#if USB_CDC_PORTS == 1
+#define USB_CDC_IN_SLOTS		4
+#else
+#define USB_CDC_IN_SLOTS		2
+#endif
+#endif
+
+#if USB_CDC_OUT_SLOTS < 2 || USB_CDC_IN_SLOTS < 2
+#error "USB_CDC_OUT_SLOTS and USB_CDC_IN_SLOTS must be at least 2"
+#endif
+
+/* The ports' USB RAM follows EP0's buffers, each port's being its receive slots, transmit slots and notification buffer */
+#define USB_CDC_RAM_ADDR		(USB_EP0_DATA_ADDR + USB_EP0_DATA_LEN)
+#define USB_CDC_PORT_RAM_LEN	((USB_CDC_OUT_SLOTS + USB_CDC_IN_SLOTS) * USB_CDC_DATA_LEN + USB_CDC_NOTIFY_LEN)
+#define USB_CDC_RAM_END			(USB_CDC_RAM_ADDR + USB_CDC_PORTS * USB_CDC_PORT_RAM_LEN)
+#if USB_CDC_RAM_END > USB_RAM_END
+#error "The CDC ports' buffers do not fit in USB RAM, reduce USB_CDC_OUT_SLOTS, USB_CDC_IN_SLOTS or USB_CDC_DATA_LEN"
+#endif
+
 #define USB_DESCRIPTOR_CDC		0x24
 
 #define USB_CDC_HEADER			0x00
@@ -104,6 +164,19 @@ typedef enum
 	USB_REQUEST_SEND_BREAK = 0x23
 } usbCDCRequest_t;
 
+#define USB_CDC_NOTIFY_REQUEST_TYPE	0xA1
+#define USB_CDC_NOTIFY_SERIAL_STATE	0x20
+
+typedef struct
+{
+	uint8_t requestType;
+	uint8_t notification;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+	uint16_t data;
+} usbCDCNotification_t;
+
 typedef struct
 {
 	uint32_t baudRate;
@@ -112,9 +185,15 @@ typedef struct
 	uint8_t dataBits;
 } usbLineCoding_t;
 
+#define USB_CDC_PARITY_NONE		0
+#define USB_CDC_PARITY_ODD		1
+#define USB_CDC_PARITY_EVEN		2
+#define USB_CDC_PARITY_MARK		3
+#define USB_CDC_PARITY_SPACE	4
+
 extern void usbCDCInit();
 extern void usbHandleCDCRequest(volatile usbBDTEntry_t *BD);
-extern void usbServiceCDCDataEP();
+extern void usbCDCServiceSOF();
 
 #ifdef	__cplusplus
 }
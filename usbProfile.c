@@ -0,0 +1,146 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "usbTypes.h"
+#include "usb.h"
+#include "usbProfile.h"
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#ifdef USB_PROFILE
+
+USB_STATIC_ASSERT(USB_PROFILE_BINS >= 2 && USB_PROFILE_BINS <= 16, profileBins);
+
+uint16_t usbProfile[USB_PROFILE_HISTOGRAMS][USB_PROFILE_BINS];
+/* The histogram being sent to the host, copied so the counts can't move under the data stage */
+uint16_t usbProfileSnapshot[USB_PROFILE_BINS];
+
+void usbProfileInit()
+{
+#ifndef USB_PROFILE_TIMER
+	/* Fosc/4, no prescaling, reads of TMR1L latching TMR1H, and on */
+	T1CON = 0x03;
+#endif
+}
+
+/*
+ * In the deferred modes usbIRQ() can come in part way through usbTask() taking or recording a time
+ * and do the same, which would upset the TMR1H latch or lose a count, so the interrupt is held off.
+ */
+#ifdef USB_DEFERRED_IRQ
+#define usbProfileLock(state) \
+	state = PIE3bits.USBIE; \
+	PIE3bits.USBIE = 0
+#define usbProfileUnlock(state) PIE3bits.USBIE = state
+#else
+#define usbProfileLock(state)
+#define usbProfileUnlock(state)
+#endif
+
+uint16_t usbProfileTime()
+{
+#ifdef USB_PROFILE_TIMER
+	return USB_PROFILE_TIMER();
+#else
+	/* TMR1L must be read first for TMR1H to hold the matching high byte */
+	uint8_t low, high;
+#ifdef USB_DEFERRED_IRQ
+	bool usbIE;
+#endif
+
+	usbProfileLock(usbIE);
+	low = TMR1L;
+	high = TMR1H;
+	usbProfileUnlock(usbIE);
+	return ((uint16_t)high << 8) | low;
+#endif
+}
+
+void usbProfileRecord(const uint8_t histogram, uint16_t ticks)
+{
+	uint16_t *bins = usbProfile[histogram];
+	uint8_t bin = 0;
+#ifdef USB_DEFERRED_IRQ
+	bool usbIE;
+#endif
+
+	while (ticks > 1 && bin < USB_PROFILE_BINS - 1)
+	{
+		ticks >>= 1;
+		++bin;
+	}
+	usbProfileLock(usbIE);
+	if (bins[bin] != 0xFFFF)
+		++bins[bin];
+	usbProfileUnlock(usbIE);
+}
+
+void usbProfileClear(const uint8_t first, const uint8_t count)
+{
+	uint16_t *bins = usbProfile[first];
+	uint8_t i;
+	for (i = 0; i < count * USB_PROFILE_BINS; ++i)
+		bins[i] = 0;
+}
+
+void usbHandleProfileRequest(volatile usbBDTEntry_t *BD)
+{
+	volatile usbSetupPacket_t *packet = addrToPtr(BD->address);
+	uint8_t histogram;
+	bool usbIE;
+
+	if (packet->requestType.type != USB_REQUEST_TYPE_VENDOR ||
+		packet->requestType.recipient != USB_RECIPIENT_DEVICE)
+		return;
+
+	/* In split mode the interrupt records times of its own, so hold it off */
+	usbIE = PIE3bits.USBIE;
+	PIE3bits.USBIE = 0;
+	switch (packet->request)
+	{
+		case USB_REQUEST_GET_PROFILE:
+			/* Check all of wIndex before narrowing it, so 0x0100 and the like don't alias histogram 0 */
+			if (packet->requestType.direction != USB_DIR_IN || packet->index.value >= USB_PROFILE_HISTOGRAMS)
+				break;
+			histogram = packet->index.value;
+			usbCopyFromMem((uint8_t *)usbProfileSnapshot, (uint8_t *)usbProfile[histogram], sizeof(usbProfileSnapshot));
+			if (packet->value.value == 1)
+				usbProfileClear(histogram, 1);
+			usbStatusInEP[0].buffSrc = USB_BUFFER_SRC_MEM;
+			usbStatusInEP[0].buffer.memPtr = usbProfileSnapshot;
+			usbStatusInEP[0].xferCount = sizeof(usbProfileSnapshot);
+			usbStatusInEP[0].needsArming = 1;
+			break;
+		case USB_REQUEST_CLEAR_PROFILE:
+			usbProfileClear(0, USB_PROFILE_HISTOGRAMS);
+			/* Generate a reply that is 0 bytes long to acknowledge */
+			usbStatusInEP[0].needsArming = 1;
+			break;
+	}
+	PIE3bits.USBIE = usbIE;
+}
+
+#endif
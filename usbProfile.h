@@ -0,0 +1,94 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBPROFILE_H
+#define	USBPROFILE_H
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#ifdef	__cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include "usbTypes.h"
+
+/*
+ * With USB_PROFILE defined the stack times its interrupt work against a free-running 16-bit timer
+ * and bins the times into log2 histograms: bin 0 counts times of 0 or 1 ticks, bin n those of
+ * 2^n up to 2^(n + 1) ticks and the last bin everything longer. The host reads a histogram
+ * as USB_PROFILE_BINS little endian counts with a vendor request to the device:
+ *   GET_PROFILE (bmRequestType 0xC0): wIndex picks the histogram, which is also cleared if wValue is 1.
+ *   CLEAR_PROFILE (bmRequestType 0x40): clears every histogram.
+ *
+ * Unless the application supplies its own USB_PROFILE_TIMER(), usbInit() starts Timer1 running
+ * from Fosc/4 and the stack takes it over. Times longer than the timer takes to wrap are not measured properly.
+ */
+#define USB_REQUEST_GET_PROFILE		0x03
+#define USB_REQUEST_CLEAR_PROFILE	0x04
+
+#ifndef USB_PROFILE_BINS
+#define USB_PROFILE_BINS			12
+#endif
+
+/*
+ * The histograms kept. The transaction paths time usbServiceTransaction() and the SOF and reset
+ * paths the handling of those; in split mode the time a bottom half spends preempted by the
+ * interrupt counts towards it. IRQ times the whole of usbIRQ(), and LATENCY how long each
+ * transaction waited between usbIRQ() or a poll picking it up and it being serviced, which in
+ * deferred mode includes the wait for usbTask().
+ */
+typedef enum
+{
+	USB_PROFILE_SETUP,
+	USB_PROFILE_CTRL_IN,
+	USB_PROFILE_CTRL_OUT,
+	USB_PROFILE_DATA,
+	USB_PROFILE_SOF,
+	USB_PROFILE_RESET,
+	USB_PROFILE_IRQ,
+	USB_PROFILE_LATENCY,
+	USB_PROFILE_HISTOGRAMS
+} usbProfileHistogram_t;
+
+#ifdef USB_PROFILE
+extern void usbProfileInit();
+extern uint16_t usbProfileTime();
+extern void usbProfileRecord(const uint8_t histogram, uint16_t ticks);
+extern void usbHandleProfileRequest(volatile usbBDTEntry_t *BD);
+
+#define usbProfileDeclare(start) uint16_t start
+#define usbProfileStart(start) start = usbProfileTime()
+#define usbProfileEnd(histogram, start) usbProfileRecord(histogram, usbProfileTime() - (start))
+#else
+#define usbProfileDeclare(start)
+#define usbProfileStart(start)
+#define usbProfileEnd(histogram, start)
+#endif
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* USBPROFILE_H */
@@ -0,0 +1,269 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "usbTypes.h"
+#include "usb.h"
+#include "usbRequests.h"
+#include "usbRaw.h"
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#ifdef USB_RAW_INTERFACE
+
+/* Depth of each direction's transfer queue, which must be a power of two no larger than 128 */
+#ifndef USB_RAW_QUEUE_LEN
+#define USB_RAW_QUEUE_LEN		4
+#endif
+USB_STATIC_ASSERT((USB_RAW_QUEUE_LEN & (USB_RAW_QUEUE_LEN - 1)) == 0 && USB_RAW_QUEUE_LEN <= 128, rawQueueLen);
+USB_STATIC_ASSERT(USB_EP_RAW < USB_ENDPOINTS, rawEPValid);
+
+typedef struct
+{
+	uint8_t *buffer;
+	uint16_t len;
+	usbRawCallback_t done;
+} usbRawXfer_t;
+
+/*
+ * Both queues are single-producer, single-consumer rings like the CDC send queue: submissions
+ * advance the head and the endpoint's side advances the tail, both free-running.
+ * rawInDone follows the tail as IN transfers finish going out, entries not being reused until then.
+ */
+volatile usbRawXfer_t rawInQueue[USB_RAW_QUEUE_LEN];
+volatile uint8_t rawInHead, rawInTail, rawInDone;
+volatile usbRawXfer_t rawOutQueue[USB_RAW_QUEUE_LEN];
+volatile uint8_t rawOutHead, rawOutTail;
+
+/*
+ * Received packets wait in the two OUT slots, oldest at rawOutSlot, until a queued transfer takes them.
+ * rawOutOffset is how much of the oldest has been taken and rawOutCount how much the transfer at
+ * the tail of the queue has received so far. rawOutDraining stops a callback submitting a transfer
+ * from draining the slots again underneath the drain that called it, and rawOutSkipZLP is set when
+ * a transfer has just been filled by a full packet, so that a ZLP after it is taken as its end.
+ */
+uint8_t rawOutLen[2];
+uint8_t rawOutSlot, rawOutFull, rawOutOffset;
+uint16_t rawOutCount;
+bool rawOutDraining, rawOutSkipZLP;
+
+/* Define the raw interface's packet buffers */
+volatile uint8_t usbRawIn[2][USB_RAW_DATA_LEN] __at(USB_RAW_IN_ADDR);
+volatile uint8_t usbRawOut[2][USB_RAW_DATA_LEN] __at(USB_RAW_OUT_ADDR);
+
+/*
+ * Hands free OUT slots to the SIE in order until both of the endpoint's
+ * OUT ping-pong buffer descriptors are armed.
+ */
+void usbRawArmOut()
+{
+	usbServiceEPArmSlots(USB_EP_RAW, (volatile uint8_t *)usbRawOut, 1, rawOutSlot + rawOutFull, 2 - rawOutFull);
+}
+
+/*
+ * Copies received packets into the queued OUT transfers, completing each as it fills or
+ * a short packet ends it, and gives emptied slots back to the SIE.
+ */
+void usbRawDrainOut()
+{
+	volatile usbRawXfer_t *xfer;
+	uint16_t count;
+	bool ended;
+
+	rawOutDraining = true;
+	while (rawOutFull != 0)
+	{
+		/* The ZLP ending a transfer the last one exactly filled belongs to that, so it is dropped */
+		if (rawOutSkipZLP)
+		{
+			rawOutSkipZLP = false;
+			if (rawOutLen[rawOutSlot] == 0)
+			{
+				rawOutSlot ^= 1;
+				--rawOutFull;
+				continue;
+			}
+		}
+		if (rawOutTail == rawOutHead)
+			break;
+		xfer = &rawOutQueue[rawOutTail & (USB_RAW_QUEUE_LEN - 1)];
+		count = xfer->len - rawOutCount;
+		if (count > (uint8_t)(rawOutLen[rawOutSlot] - rawOutOffset))
+			count = rawOutLen[rawOutSlot] - rawOutOffset;
+		usbCopyFromMem(xfer->buffer + rawOutCount, usbRawOut[rawOutSlot] + rawOutOffset, count);
+		rawOutCount += count;
+		rawOutOffset += count;
+
+		ended = false;
+		if (rawOutOffset == rawOutLen[rawOutSlot])
+		{
+			/* A short packet, including a ZLP, ends the transfer once it has all been taken */
+			ended = rawOutLen[rawOutSlot] < USB_RAW_DATA_LEN;
+			rawOutSlot ^= 1;
+			--rawOutFull;
+			rawOutOffset = 0;
+		}
+		if (ended || rawOutCount == xfer->len)
+		{
+			/* Filled by a full packet, so the host may yet send a ZLP to end the transfer its side */
+			rawOutSkipZLP = !ended && rawOutOffset == 0;
+			count = rawOutCount;
+			rawOutCount = 0;
+			++rawOutTail;
+			xfer->done(xfer->buffer, count);
+		}
+	}
+	usbRawArmOut();
+	rawOutDraining = false;
+}
+
+void usbRawHandleOut(void *context)
+{
+	(void)context;
+	/* Packets complete in the order their slots were armed */
+	rawOutLen[(rawOutSlot + rawOutFull) & 1] = usbBDT[usbPacket.value].count;
+	++rawOutFull;
+	--usbStatusOutEP[USB_EP_RAW].armedCount;
+	usbRawDrainOut();
+}
+
+/*
+ * Takes the transfer at the tail of the IN queue and makes it the endpoint's current one.
+ * Returns false if there was nothing queued.
+ */
+bool usbRawNextIn(void *context)
+{
+	volatile usbRawXfer_t *xfer;
+	(void)context;
+	if (rawInTail == rawInHead)
+		return false;
+	xfer = &rawInQueue[rawInTail & (USB_RAW_QUEUE_LEN - 1)];
+	usbServiceEPStartIn(USB_EP_RAW, xfer->buffer, xfer->len);
+	++rawInTail;
+	return true;
+}
+
+/*
+ * Keeps both of the endpoint's IN buffer descriptors armed for as long as there are transfers queued.
+ */
+void usbRawQueueIn()
+{
+	usbServiceEPQueueIn(USB_EP_RAW, usbRawNextIn, NULL, true);
+}
+
+/*
+ * Runs as each IN transfer finishes going out, which happens in queue order.
+ */
+void usbRawInDone()
+{
+	volatile usbRawXfer_t *xfer = &rawInQueue[rawInDone & (USB_RAW_QUEUE_LEN - 1)];
+	++rawInDone;
+	xfer->done(xfer->buffer, xfer->len);
+}
+
+void usbRawHandleIn(void *context)
+{
+	(void)context;
+	usbRawQueueIn();
+}
+
+void usbRawInit()
+{
+	rawInHead = 0;
+	rawInTail = 0;
+	rawInDone = 0;
+	rawOutHead = 0;
+	rawOutTail = 0;
+	rawOutSlot = 0;
+	rawOutFull = 0;
+	rawOutOffset = 0;
+	rawOutCount = 0;
+	rawOutDraining = false;
+	rawOutSkipZLP = false;
+
+	/* The first packet each way is DATA0 */
+	usbStatusOutEP[USB_EP_RAW].dataToggle = 0;
+	usbStatusOutEP[USB_EP_RAW].armedCount = 0;
+	usbRawArmOut();
+
+	usbStatusInEP[USB_EP_RAW].buffAddr = USB_RAW_IN_ADDR;
+	usbStatusInEP[USB_EP_RAW].dataToggle = 0;
+	usbStatusInEP[USB_EP_RAW].xferEnds = 0;
+	usbStatusInEP[USB_EP_RAW].armedCount = 0;
+	usbStatusInEP[USB_EP_RAW].func = usbRawInDone;
+
+	usbRegisterEPHandler(USB_EP_RAW, USB_DIR_OUT, usbRawHandleOut, NULL);
+	usbRegisterEPHandler(USB_EP_RAW, USB_DIR_IN, usbRawHandleIn, NULL);
+}
+
+bool usbRawSubmitIn(uint8_t *buffer, uint16_t len, usbRawCallback_t done)
+{
+	volatile usbRawXfer_t *xfer;
+	bool lockState;
+
+	if (len == 0 || usbState != USB_STATE_CONFIGURED ||
+		(uint8_t)(rawInHead - rawInDone) == USB_RAW_QUEUE_LEN)
+		return false;
+	xfer = &rawInQueue[rawInHead & (USB_RAW_QUEUE_LEN - 1)];
+	xfer->buffer = buffer;
+	xfer->len = len;
+	xfer->done = done;
+	++rawInHead;
+
+	/* If the endpoint was idle, nothing will come along to pick the transfer up, so start it going */
+	if (usbStatusInEP[USB_EP_RAW].armedCount == 0)
+	{
+		lockState = usbLock();
+		usbRawQueueIn();
+		usbUnlock(lockState);
+	}
+	return true;
+}
+
+bool usbRawSubmitOut(uint8_t *buffer, uint16_t len, usbRawCallback_t done)
+{
+	volatile usbRawXfer_t *xfer;
+	bool lockState;
+
+	if (len == 0 || usbState != USB_STATE_CONFIGURED ||
+		(uint8_t)(rawOutHead - rawOutTail) == USB_RAW_QUEUE_LEN)
+		return false;
+	xfer = &rawOutQueue[rawOutHead & (USB_RAW_QUEUE_LEN - 1)];
+	xfer->buffer = buffer;
+	xfer->len = len;
+	xfer->done = done;
+	++rawOutHead;
+
+	/* Packets may already be waiting for somewhere to go */
+	if (!rawOutDraining)
+	{
+		lockState = usbLock();
+		usbRawDrainOut();
+		usbUnlock(lockState);
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBRAW_H
+#define	USBRAW_H
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#ifdef	__cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usbTypes.h"
+#include "usbCDC.h"
+
+/*
+ * With USB_RAW_INTERFACE defined the device also presents a vendor-class interface with a bulk
+ * IN and OUT endpoint pair for raw binary transfers. It follows the CDC ports' interfaces and endpoints,
+ * and its packet buffers follow theirs in USB RAM.
+ */
+#define USB_IFACE_RAW			(USB_CDC_PORTS << 1)
+#define USB_EP_RAW				((USB_CDC_PORTS << 1) + 1)
+#define USB_RAW_DATA_LEN		64
+
+#define USB_RAW_IN_ADDR			USB_CDC_RAM_END
+#define USB_RAW_OUT_ADDR		(USB_RAW_IN_ADDR + 2 * USB_RAW_DATA_LEN)
+#define USB_RAW_RAM_END			(USB_RAW_OUT_ADDR + 2 * USB_RAW_DATA_LEN)
+#if defined(USB_RAW_INTERFACE) && USB_RAW_RAM_END > USB_RAM_END
+#error "The raw interface's buffers do not fit in USB RAM after the CDC ports'"
+#endif
+
+/* Called with the buffer a transfer was submitted with and how many bytes it actually moved */
+typedef void (*usbRawCallback_t)(uint8_t *buffer, uint16_t len);
+
+extern void usbRawInit();
+
+/*
+ * The submit calls return false, queueing nothing, for an empty buffer, when the device is not configured or
+ * when USB_RAW_QUEUE_LEN transfers are already queued. Transfers still queued when the host resets
+ * or reconfigures the device are dropped without their callbacks being called.
+ */
+
+/*
+ * Queues buffer to be sent to the host, done being called from the USB interrupt once it has all gone.
+ * A buffer in USB RAM is handed to the SIE in place, anything else is copied out a packet at a time.
+ * Transfers queued back to back run together into one stream, a transfer that ends on a packet
+ * boundary only being terminated with a ZLP when nothing follows it.
+ */
+extern bool usbRawSubmitIn(uint8_t *buffer, uint16_t len, usbRawCallback_t done);
+/*
+ * Queues buffer to receive up to len bytes from the host, done being called from the USB interrupt
+ * once it is full or a short packet ends the transfer early. When a full packet fills the buffer, a ZLP
+ * coming straight after is taken as the host ending the same transfer and dropped, rather than
+ * completing the next queued transfer with nothing in it.
+ */
+extern bool usbRawSubmitOut(uint8_t *buffer, uint16_t len, usbRawCallback_t done);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* USBRAW_H */
@@ -18,10 +18,12 @@
 
 #include <xc.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "usb.h"
 #include "usbTypes.h"
 #include "usbRequests.h"
 #include "usbCDC.h"
+#include "usbRaw.h"
 
 /*
  * @file
@@ -35,9 +37,13 @@
 #define USB_PID 0x2122
 
 #define USB_NUM_CONFIG_DESC		1
-#define USB_NUM_IFACE_DESC		2
-#define USB_NUM_ENDPOINT_DESC	3
-#define USB_NUM_CONFIG_SECS		11
+#ifndef USB_RAW_INTERFACE
+#define USB_NUM_IFACE_DESC		(2 * USB_CDC_PORTS)
+#define USB_NUM_ENDPOINT_DESC	(3 * USB_CDC_PORTS)
+#else
+#define USB_NUM_IFACE_DESC		(2 * USB_CDC_PORTS + 1)
+#define USB_NUM_ENDPOINT_DESC	(3 * USB_CDC_PORTS + 2)
+#endif
 #define USB_NUM_STRING_DESC		4
 
 #define USB_EPDIR_IN			0x80
@@ -48,9 +54,10 @@ const usbDeviceDescriptor_t usbDeviceDesc =
 	sizeof(usbDeviceDescriptor_t),
 	USB_DESCRIPTOR_DEVICE,
 	0x0200, /* this is 2.00 in USB's BCD format */
-	USB_CLASS_COMMS,
-	USB_SUBCLASS_NONE,
-	USB_PROTOCOL_NONE,
+	/* The functions are described by interface association descriptors */
+	USB_CLASS_MISC,
+	USB_SUBCLASS_COMMON,
+	USB_PROTOCOL_IAD,
 	USB_EP0_SETUP_LEN,
 	USB_VID,
 	USB_PID,
@@ -61,177 +68,315 @@ const usbDeviceDescriptor_t usbDeviceDesc =
 	USB_NUM_CONFIG_DESC /* One configuration only */
 };
 
-const usbConfigDescriptor_t usbConfigDesc[USB_NUM_CONFIG_DESC] =
+/* The descriptors of one CDC ACM port, from its association descriptor through to its data interface */
+typedef struct
+{
+	usbInterfaceAssocDescriptor_t assoc;
+	usbInterfaceDescriptor_t commIface;
+	usbCDCHeader_t header;
+	usbCDCHeaderACM_t acm;
+	usbCDCUnion2_t cdcUnion;
+	usbCDCCallMgmt_t callMgmt;
+	usbEndpointDescriptor_t notifyEP;
+	usbInterfaceDescriptor_t dataIface;
+	usbEndpointDescriptor_t dataInEP;
+	usbEndpointDescriptor_t dataOutEP;
+} usbCDCFunctionDesc_t;
+
+/*
+ * The complete descriptor set for our configuration, laid out exactly as it goes
+ * over the wire so GET_DESCRIPTOR(CONFIGURATION) is a single linear copy from flash
+ * and totalLength is simply its size.
+ */
+typedef struct
+{
+	usbConfigDescriptor_t config;
+	usbCDCFunctionDesc_t cdc[USB_CDC_PORTS];
+#ifdef USB_RAW_INTERFACE
+	usbInterfaceDescriptor_t rawIface;
+	usbEndpointDescriptor_t rawInEP;
+	usbEndpointDescriptor_t rawOutEP;
+#endif
+} usbConfigSet_t;
+
+/* The set is sent as-is so must not contain any padding */
+USB_STATIC_ASSERT(sizeof(usbCDCFunctionDesc_t) == sizeof(usbInterfaceAssocDescriptor_t) +
+	sizeof(usbInterfaceDescriptor_t) + sizeof(usbCDCHeader_t) + sizeof(usbCDCHeaderACM_t) +
+	sizeof(usbCDCUnion2_t) + sizeof(usbCDCCallMgmt_t) + sizeof(usbEndpointDescriptor_t) +
+	sizeof(usbInterfaceDescriptor_t) + sizeof(usbEndpointDescriptor_t) + sizeof(usbEndpointDescriptor_t),
+	cdcFunctionPacked);
+#ifndef USB_RAW_INTERFACE
+USB_STATIC_ASSERT(sizeof(usbConfigSet_t) == sizeof(usbConfigDescriptor_t) +
+	USB_CDC_PORTS * sizeof(usbCDCFunctionDesc_t), configSetPacked);
+#else
+USB_STATIC_ASSERT(sizeof(usbConfigSet_t) == sizeof(usbConfigDescriptor_t) +
+	USB_CDC_PORTS * sizeof(usbCDCFunctionDesc_t) + sizeof(usbInterfaceDescriptor_t) +
+	sizeof(usbEndpointDescriptor_t) + sizeof(usbEndpointDescriptor_t), configSetPacked);
+#endif
+/* Every port's endpoints must exist */
+USB_STATIC_ASSERT(USB_EP_CDC_NOTIFY(USB_CDC_PORTS - 1) < USB_ENDPOINTS, cdcEPsValid);
+/* Full speed bulk and interrupt endpoints top out at 64 byte packets */
+USB_STATIC_ASSERT(USB_CDC_DATA_LEN <= 64 && USB_CDC_NOTIFY_LEN <= 64 && USB_RAW_DATA_LEN <= 64, epLengthsValid);
+
+#define USB_CDC_FUNCTION_DESC(port) \
+	{ \
+		{ \
+			sizeof(usbInterfaceAssocDescriptor_t), \
+			USB_DESCRIPTOR_INTERFACE_ASSOCIATION, \
+			USB_IFACE_CDC_COMM(port), /* First interface is the comms one */ \
+			2, /* Two interfaces involved contiguously */ \
+			USB_CLASS_COMMS, \
+			USB_SUBCLASS_ACM, \
+			USB_PROTOCOL_NONE, \
+			0x03 /* Configuration string index */ \
+		}, \
+		{ \
+			sizeof(usbInterfaceDescriptor_t), \
+			USB_DESCRIPTOR_INTERFACE, \
+			USB_IFACE_CDC_COMM(port), \
+			0x00, /* Alternate 0 */ \
+			0x01, /* One endpoint to the interface */ \
+			USB_CLASS_COMMS, \
+			USB_SUBCLASS_ACM, \
+			USB_PROTOCOL_NONE, \
+			0x00 /* No string to describe this interface */ \
+		}, \
+		{ \
+			sizeof(usbCDCHeader_t), \
+			USB_DESCRIPTOR_CDC, \
+			USB_CDC_HEADER, \
+			0x0110 \
+		}, \
+		{ \
+			sizeof(usbCDCHeaderACM_t), \
+			USB_DESCRIPTOR_CDC, \
+			USB_CDC_ACM, \
+			USB_ACM_LINE_CODING /* Set break here does not make any sense */ \
+		}, \
+		{ \
+			sizeof(usbCDCUnion2_t), \
+			USB_DESCRIPTOR_CDC, \
+			USB_CDC_UNION, \
+			USB_IFACE_CDC_COMM(port), \
+			USB_IFACE_CDC_DATA(port) \
+		}, \
+		{ \
+			sizeof(usbCDCCallMgmt_t), \
+			USB_DESCRIPTOR_CDC, \
+			USB_CDC_CM, \
+			USB_CDC_CM_SELF_MANAGE, \
+			USB_IFACE_CDC_DATA(port) \
+		}, \
+		{ \
+			sizeof(usbEndpointDescriptor_t), \
+			USB_DESCRIPTOR_ENDPOINT, \
+			USB_EPDIR_IN | USB_EP_CDC_NOTIFY(port), \
+			USB_EPTYPE_INTR, \
+			USB_CDC_NOTIFY_LEN, \
+			0x01 /* Poll once per frame */ \
+		}, \
+		{ \
+			sizeof(usbInterfaceDescriptor_t), \
+			USB_DESCRIPTOR_INTERFACE, \
+			USB_IFACE_CDC_DATA(port), \
+			0x00, /* Alternate 0 */ \
+			0x02, /* Two endpoints to the interface */ \
+			USB_CLASS_DATA, \
+			USB_SUBCLASS_NONE, \
+			USB_PROTOCOL_NONE, \
+			0x00 /* No string to describe this interface */ \
+		}, \
+		{ \
+			sizeof(usbEndpointDescriptor_t), \
+			USB_DESCRIPTOR_ENDPOINT, \
+			USB_EPDIR_IN | USB_EP_CDC_DATA(port), \
+			USB_EPTYPE_BULK, \
+			USB_CDC_DATA_LEN, \
+			0x01 /* Poll once per frame */ \
+		}, \
+		{ \
+			sizeof(usbEndpointDescriptor_t), \
+			USB_DESCRIPTOR_ENDPOINT, \
+			USB_EPDIR_OUT | USB_EP_CDC_DATA(port), \
+			USB_EPTYPE_BULK, \
+			USB_CDC_DATA_LEN, \
+			0x01 /* Poll once per frame */ \
+		} \
+	}
+
+const usbConfigSet_t usbConfigSet =
 {
 	{
 		sizeof(usbConfigDescriptor_t),
 		USB_DESCRIPTOR_CONFIGURATION,
-		sizeof(usbConfigDescriptor_t) + sizeof(usbInterfaceAssocDescriptor_t) +
-		sizeof(usbInterfaceDescriptor_t) + sizeof(usbCDCHeader_t) +
-		sizeof(usbCDCHeaderACM_t) + sizeof(usbCDCUnion2_t) + sizeof(usbCDCCallMgmt_t) +
-		sizeof(usbEndpointDescriptor_t) + sizeof(usbInterfaceDescriptor_t) +
-		sizeof(usbEndpointDescriptor_t) + sizeof(usbEndpointDescriptor_t),
-		0x02, /* One interface */
+		sizeof(usbConfigSet_t),
+		USB_NUM_IFACE_DESC, /* Two interfaces per port, plus the raw one */
 		0x01, /* This is the first configuration */
 		0x03, /* Configuration string index */
 		USB_CONF_ATTR_DEFAULT | USB_CONF_ATTR_SELFPWR,
 		50 /* 100mA max */
-	}
-};
-
-const usbInterfaceDescriptor_t usbInterfaceDesc[USB_NUM_IFACE_DESC] =
-{
+	},
 	{
-		sizeof(usbInterfaceDescriptor_t),
-		USB_DESCRIPTOR_INTERFACE,
-		0x00, /* 0th interface, by which we mean 1st */
-		0x00, /* Alternate 0 */
-		0x01, /* Two endpoints to the interface */
-		USB_CLASS_COMMS,
-		USB_SUBCLASS_ACM,
-		USB_PROTOCOL_NONE,
-		0x00 /* No string to describe this interface */
+		USB_CDC_FUNCTION_DESC(0),
+#if USB_CDC_PORTS > 1
+		USB_CDC_FUNCTION_DESC(1),
+#endif
+#if USB_CDC_PORTS > 2
+		USB_CDC_FUNCTION_DESC(2),
+#endif
 	},
+#ifdef USB_RAW_INTERFACE
 	{
 		sizeof(usbInterfaceDescriptor_t),
 		USB_DESCRIPTOR_INTERFACE,
-		0x01, /* 1st interface, by which we mean 2nd */
+		USB_IFACE_RAW,
 		0x00, /* Alternate 0 */
-		0x02, /* One endpoint to the interface */
-		USB_CLASS_DATA,
-		USB_SUBCLASS_NONE,
-		USB_PROTOCOL_NONE,
+		0x02, /* Two endpoints to the interface */
+		USB_CLASS_VENDOR,
+		USB_SUBCLASS_VENDOR,
+		USB_PROTOCOL_VENDOR,
 		0x00 /* No string to describe this interface */
-	}
-};
-
-const usbEndpointDescriptor_t usbEndpointDesc[USB_NUM_ENDPOINT_DESC] =
-{
-	{
-		sizeof(usbEndpointDescriptor_t),
-		USB_DESCRIPTOR_ENDPOINT,
-		USB_EPDIR_IN | 2,
-		USB_EPTYPE_INTR,
-		USB_EP2_IN_LEN,
-		0x01 /* Poll once per frame */
 	},
 	{
 		sizeof(usbEndpointDescriptor_t),
 		USB_DESCRIPTOR_ENDPOINT,
-		USB_EPDIR_IN | 1,
+		USB_EPDIR_IN | USB_EP_RAW,
 		USB_EPTYPE_BULK,
-		USB_EP1_IN_LEN,
+		USB_RAW_DATA_LEN,
 		0x01 /* Poll once per frame */
 	},
 	{
 		sizeof(usbEndpointDescriptor_t),
 		USB_DESCRIPTOR_ENDPOINT,
-		USB_EPDIR_OUT | 1,
+		USB_EPDIR_OUT | USB_EP_RAW,
 		USB_EPTYPE_BULK,
-		USB_EP1_OUT_LEN,
+		USB_RAW_DATA_LEN,
 		0x01 /* Poll once per frame */
 	}
+#endif
 };
 
-const usbInterfaceAssocDescriptor_t usbInterfaceAssocDesc =
+const usbConfigDescriptor_t *const usbConfigDescs[USB_NUM_CONFIG_DESC] =
 {
-	sizeof(usbInterfaceAssocDescriptor_t),
-	USB_DESCRIPTOR_INTERFACE_ASSOCIATION,
-	0, /* First interface is #1 */
-	2, /* Two interfaces involved contiguously */
-	USB_CLASS_COMMS,
-	USB_SUBCLASS_ACM,
-	USB_PROTOCOL_NONE,
-	0x03 /* Configuration string index */
+	&usbConfigSet.config
 };
 
-const usbCDCHeader_t usbCDCHeader =
-{
-	sizeof(usbCDCHeader_t),
-	USB_DESCRIPTOR_CDC,
-	USB_CDC_HEADER,
-	0x0110
-};
+#define USB_CDC_IFACE_DESCS(port) \
+	&usbConfigSet.cdc[port].commIface, \
+	&usbConfigSet.cdc[port].dataIface
 
-const usbCDCHeaderACM_t usbCDCHeaderACM =
+const usbInterfaceDescriptor_t *const usbInterfaceDescs[USB_NUM_IFACE_DESC] =
 {
-	sizeof(usbCDCHeaderACM_t),
-	USB_DESCRIPTOR_CDC,
-	USB_CDC_ACM,
-	USB_ACM_LINE_CODING /* Set break here does not make any sense */
+	USB_CDC_IFACE_DESCS(0),
+#if USB_CDC_PORTS > 1
+	USB_CDC_IFACE_DESCS(1),
+#endif
+#if USB_CDC_PORTS > 2
+	USB_CDC_IFACE_DESCS(2),
+#endif
+#ifdef USB_RAW_INTERFACE
+	&usbConfigSet.rawIface
+#endif
 };
 
-const usbCDCUnion2_t usbCDCUnion =
+#define USB_CDC_ENDPOINT_DESCS(port) \
+	&usbConfigSet.cdc[port].notifyEP, \
+	&usbConfigSet.cdc[port].dataInEP, \
+	&usbConfigSet.cdc[port].dataOutEP
+
+const usbEndpointDescriptor_t *const usbEndpointDescs[USB_NUM_ENDPOINT_DESC] =
 {
-	sizeof(usbCDCUnion2_t),
-	USB_DESCRIPTOR_CDC,
-	USB_CDC_UNION,
-	0,
-	1
+	USB_CDC_ENDPOINT_DESCS(0),
+#if USB_CDC_PORTS > 1
+	USB_CDC_ENDPOINT_DESCS(1),
+#endif
+#if USB_CDC_PORTS > 2
+	USB_CDC_ENDPOINT_DESCS(2),
+#endif
+#ifdef USB_RAW_INTERFACE
+	&usbConfigSet.rawInEP,
+	&usbConfigSet.rawOutEP
+#endif
 };
 
-const usbCDCCallMgmt_t usbCDCCallMgmt =
+/*
+ * What SET_CONFIGURATION has to set up for each configuration, worked out ahead of time from the
+ * same constants as the descriptors: the UEPn value and packet sizes of each endpoint the
+ * configuration uses, and the function driver to start once they are ready.
+ */
+typedef struct
 {
-	sizeof(usbCDCCallMgmt_t),
-	USB_DESCRIPTOR_CDC,
-	USB_CDC_CM,
-	USB_CDC_CM_SELF_MANAGE,
-	2
-};
+	uint8_t ep;
+	uint8_t uep;
+	uint8_t inLen;
+	uint8_t outLen;
+	uint8_t noZLP;
+} usbEPImage_t;
+
+typedef struct
+{
+	uint8_t numEndpoints;
+	const usbEPImage_t *endpoints;
+	void (*init)();
+} usbConfigImage_t;
+
+#ifndef USB_RAW_INTERFACE
+#define USB_CONFIG1_ENDPOINTS	(2 * USB_CDC_PORTS)
+#else
+#define USB_CONFIG1_ENDPOINTS	(2 * USB_CDC_PORTS + 1)
+#endif
+
+#define USB_CDC_EP_IMAGES(port) \
+	{ \
+		USB_EP_CDC_DATA(port), \
+		USB_UEP_HSHK | USB_UEP_CONDIS | USB_UEP_OUTEN | USB_UEP_INEN, \
+		USB_CDC_DATA_LEN, \
+		USB_CDC_DATA_LEN, \
+		0 \
+	}, \
+	{ \
+		USB_EP_CDC_NOTIFY(port), \
+		USB_UEP_HSHK | USB_UEP_CONDIS | USB_UEP_INEN, \
+		USB_CDC_NOTIFY_LEN, \
+		0, \
+		0 \
+	}
 
-const usbMultiPartDesc_t usbConfigSecs[USB_NUM_CONFIG_SECS] =
+const usbEPImage_t usbConfig1Endpoints[USB_CONFIG1_ENDPOINTS] =
 {
-	{
-		sizeof(usbConfigDescriptor_t),
-		&usbConfigDesc[0]
-	},
-	{
-		sizeof(usbInterfaceAssocDescriptor_t),
-		&usbInterfaceAssocDesc
-	},
-	{
-		sizeof(usbInterfaceDescriptor_t),
-		&usbInterfaceDesc[0]
-	},
-	{
-		sizeof(usbCDCHeader_t),
-		&usbCDCHeader
-	},
-	{
-		sizeof(usbCDCHeaderACM_t),
-		&usbCDCHeaderACM
-	},
-	{
-		sizeof(usbCDCUnion2_t),
-		&usbCDCUnion
-	},
-	{
-		sizeof(usbCDCCallMgmt_t),
-		&usbCDCCallMgmt
-	},
-	{
-		sizeof(usbEndpointDescriptor_t),
-		&usbEndpointDesc[0]
-	},
-	{
-		sizeof(usbInterfaceDescriptor_t),
-		&usbInterfaceDesc[1]
-	},
-	{
-		sizeof(usbEndpointDescriptor_t),
-		&usbEndpointDesc[1]
-	},
-	{
-		sizeof(usbEndpointDescriptor_t),
-		&usbEndpointDesc[2]
+	USB_CDC_EP_IMAGES(0),
+#if USB_CDC_PORTS > 1
+	USB_CDC_EP_IMAGES(1),
+#endif
+#if USB_CDC_PORTS > 2
+	USB_CDC_EP_IMAGES(2),
+#endif
+#ifdef USB_RAW_INTERFACE
+	{
+		USB_EP_RAW,
+		USB_UEP_HSHK | USB_UEP_CONDIS | USB_UEP_OUTEN | USB_UEP_INEN,
+		USB_RAW_DATA_LEN,
+		USB_RAW_DATA_LEN,
+		0
 	}
+#endif
 };
 
-const usbMultiPartTable_t usbConfigDescs[USB_NUM_CONFIG_DESC] =
+/* Starts the function drivers of the first configuration */
+void usbConfig1Init()
+{
+	usbCDCInit();
+#ifdef USB_RAW_INTERFACE
+	usbRawInit();
+#endif
+}
+
+const usbConfigImage_t usbConfigImages[USB_NUM_CONFIG_DESC] =
 {
 	{
-		USB_NUM_CONFIG_SECS,
-		usbConfigSecs
+		USB_CONFIG1_ENDPOINTS,
+		usbConfig1Endpoints,
+		usbConfig1Init
 	}
 };
 
@@ -324,16 +469,9 @@ void usbRequestGetDescriptor()
 			case USB_DESCRIPTOR_CONFIGURATION:
 				if (packet->value.descriptor.index < USB_NUM_CONFIG_DESC)
 				{
-					uint8_t i;
-					const usbMultiPartTable_t *configDesc = &usbConfigDescs[packet->value.descriptor.index];
-					usbStatusInEP[0].buffer.flashPtr = configDesc->descriptors[0].descriptor;
-					usbStatusInEP[0].xferCount = 0;
-					for (i = 0; i < configDesc->numDesc; i++)
-						usbStatusInEP[0].xferCount += configDesc->descriptors[i].length;
-					usbStatusInEP[0].multiPart = 1;
-					usbStatusInEP[0].part = 1;
-					usbStatusInEP[0].partDesc = configDesc;
-					usbStatusInEP[0].partCount = configDesc->descriptors[0].length;
+					const usbConfigDescriptor_t *configDesc = usbConfigDescs[packet->value.descriptor.index];
+					usbStatusInEP[0].buffer.flashPtr = configDesc;
+					usbStatusInEP[0].xferCount = configDesc->totalLength;
 				}
 				else
 					usbStatusInEP[0].value = 0;
@@ -341,7 +479,7 @@ void usbRequestGetDescriptor()
 			case USB_DESCRIPTOR_INTERFACE:
 				if (packet->value.descriptor.index < USB_NUM_IFACE_DESC)
 				{
-					const usbInterfaceDescriptor_t *ifaceDesc = &usbInterfaceDesc[packet->value.descriptor.index];
+					const usbInterfaceDescriptor_t *ifaceDesc = usbInterfaceDescs[packet->value.descriptor.index];
 					usbStatusInEP[0].buffer.flashPtr = ifaceDesc;
 					usbStatusInEP[0].xferCount = ifaceDesc->length;
 				}
@@ -351,7 +489,7 @@ void usbRequestGetDescriptor()
 			case USB_DESCRIPTOR_ENDPOINT:
 				if (packet->value.descriptor.index < USB_NUM_ENDPOINT_DESC)
 				{
-					const usbEndpointDescriptor_t *epDesc = &usbEndpointDesc[packet->value.descriptor.index];
+					const usbEndpointDescriptor_t *epDesc = usbEndpointDescs[packet->value.descriptor.index];
 					usbStatusInEP[0].buffer.flashPtr = epDesc;
 					usbStatusInEP[0].xferCount = epDesc->length;
 				}
@@ -374,31 +512,78 @@ void usbRequestGetDescriptor()
 	}
 }
 
+/*
+ * Puts an endpoint a configuration uses into, or takes it back out of, service.
+ * Its buffer descriptors and driver state are cleared either way, and the function
+ * driver registers its handlers again as it initialises.
+ */
+void usbApplyEndpoint(const usbEPImage_t *endpoint, bool enable)
+{
+	uint8_t ep = endpoint->ep, bd = ep << 2;
+
+	if (enable)
+		(&UEP0)[ep] = endpoint->uep;
+	else
+		(&UEP0)[ep] = 0;
+
+	/* Each endpoint owns four consecutive BDT entries: OUT even/odd then IN even/odd */
+	for (; bd < ((ep + 1) << 2); bd++)
+	{
+		usbBDT[bd].status.value = 0;
+		usbBDT[bd].count = 0;
+		usbBDT[bd].address = 0;
+	}
+
+	usbStatusInEP[ep].value = 0;
+	usbStatusInEP[ep].xferCount = 0;
+	usbStatusInEP[ep].armedCount = 0;
+	usbStatusInEP[ep].gatherEnds = 0;
+	usbStatusInEP[ep].ep.buff = 0;
+	usbStatusInEP[ep].epLen = endpoint->inLen;
+	usbStatusInEP[ep].noZLP = endpoint->noZLP;
+	usbStatusOutEP[ep].value = 0;
+	usbStatusOutEP[ep].xferCount = 0;
+	usbStatusOutEP[ep].armedCount = 0;
+	usbStatusOutEP[ep].ep.buff = 0;
+	usbStatusOutEP[ep].epLen = endpoint->outLen;
+	usbRegisterEPHandler(ep, USB_DIR_IN, NULL, NULL);
+	usbRegisterEPHandler(ep, USB_DIR_OUT, NULL, NULL);
+}
+
 void usbRequestSetConfiguration()
 {
 	uint8_t i;
 	volatile usbSetupPacket_t *packet = addrToPtr(USB_EP0_SETUP_ADDR);
+	const usbConfigImage_t *image;
+#ifdef USB_SPLIT_IRQ
+	bool lockState;
+#endif
 
 	/* Generate a 0 length ack for this */
 	usbStatusInEP[0].needsArming = 1;
-	/* And reset all non-EP0 endpoints */
-	for (i = 1; i < USB_ENDPOINTS; i++)
-		(&UEP0)[i] = 0;
-	/* Reset all BDT entiries to pristine state */
-	for (i = 0; i < USB_BDT_ENTRIES; i++)
+	/* The data endpoints are torn down and brought back up under the interrupt's feet in split mode */
+	usbTaskLock(lockState);
+
+	/* Take down just the endpoints the old configuration was using */
+	if (usbActiveConfig != 0 && usbActiveConfig <= USB_NUM_CONFIG_DESC)
+	{
+		image = &usbConfigImages[usbActiveConfig - 1];
+		for (i = 0; i < image->numEndpoints; i++)
+			usbApplyEndpoint(&image->endpoints[i], false);
+	}
+
+	/* Reset EP0's BDT entries, they get re-armed as this request completes */
+	for (i = 0; i < 4; i++)
 	{
 		usbBDT[i].status.value = 0;
 		usbBDT[i].count = 0;
 		usbBDT[i].address = 0;
 	}
 
-	/* Reset the ping-pong buffers, and their states */
+	/* Reset the ping-pong buffers, and EP0's states */
 	UCONbits.PPBRST = 1;
-	for (i = 0; i < USB_ENDPOINTS; i++)
-	{
-		usbStatusInEP[i].ep.buff = 0;
-		usbStatusOutEP[i].ep.buff = 0;
-	}
+	usbStatusInEP[0].ep.buff = 0;
+	usbStatusOutEP[0].ep.buff = 0;
 	UCONbits.PPBRST = 0;
 
 	/* Reset alternate interface setting and set active config */
@@ -408,44 +593,13 @@ void usbRequestSetConfiguration()
 		usbState = USB_STATE_ADDRESSED;
 	else if (usbActiveConfig <= USB_NUM_CONFIG_DESC)
 	{
-		uint8_t configIdx = usbActiveConfig - 1;
-		uint8_t j, ifaceIdx = 0, endpointIdx = 0;
-
 		usbState = USB_STATE_CONFIGURED;
-		/* Count interfaces to arrive at the first to deref */
-		for (i = 0; i < configIdx; i++)
-		{
-			j = ifaceIdx;
-			ifaceIdx += usbConfigDesc[i].numInterfaces;
-			for (; j < ifaceIdx; j++)
-				endpointIdx += usbInterfaceDesc[j].numEndpoints;
-		}
-
-		for (i = 0; i < usbConfigDesc[configIdx].numInterfaces; i++)
-		{
-			for (j = 0; j < usbInterfaceDesc[i].numEndpoints; j++)
-			{
-				const usbEndpointDescriptor_t *endpoint = &usbEndpointDesc[endpointIdx + j];
-				volatile uint8_t *ep = &UEP0 + (endpoint->endpointAddress & 0x7F);
-				uint8_t epType = endpoint->attributes & 0x03;
-
-				/* Disable control transfers on the endpoint */
-				*ep |= 0x08;
-				/* And enable the direction requested*/
-				if ((endpoint->endpointAddress & 0x80) == USB_EPDIR_IN)
-					*ep |= 0x02;
-				else
-					*ep |= 0x04;
-
-				/* Bulk and interrupt endpoints don't want ISO enabled */
-				if (epType == USB_EPTYPE_BULK || epType == USB_EPTYPE_INTR)
-					*ep |= 0x10;
-			}
-			endpointIdx += j;
-		}
-
-		usbCDCInit();
+		image = &usbConfigImages[usbActiveConfig - 1];
+		for (i = 0; i < image->numEndpoints; i++)
+			usbApplyEndpoint(&image->endpoints[i], true);
+		image->init();
 	}
+	usbTaskUnlock(lockState);
 }
 
 void usbRequestGetStatus()
@@ -490,7 +644,7 @@ void usbRequestGetStatus()
 	/* If something generated something to report, set up the endpoint state for it */
 	if (usbStatusInEP[0].needsArming)
 	{
-		usbStatusInEP[0].buffer.memPtr = dataBuff;
+		usbStatusInEP[0].buffer.memPtr = (void *)dataBuff;
 		usbStatusInEP[0].buffSrc = USB_BUFFER_SRC_MEM;
 		usbStatusInEP[0].xferCount = 2;
 	}
@@ -532,7 +686,7 @@ bool usbHandleStandardRequest(volatile usbSetupPacket_t *packet)
 		case USB_REQUEST_GET_CONFIGURATION:
 			/* Returns the index of the active configuration */
 			usbStatusInEP[0].buffSrc = USB_BUFFER_SRC_MEM;
-			usbStatusInEP[0].buffer.memPtr = &usbActiveConfig;
+			usbStatusInEP[0].buffer.memPtr = (void *)&usbActiveConfig;
 			usbStatusInEP[0].xferCount = 1;
 			usbStatusInEP[0].needsArming = 1;
 			return true;
@@ -0,0 +1,90 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "usbTypes.h"
+#include "usb.h"
+#include "usbStats.h"
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#ifdef USB_STATS
+
+USB_STATIC_ASSERT(USB_STATS_ENDPOINTS <= USB_ENDPOINTS, statsEndpoints);
+/* The snapshot is copied with usbCopyFromMem(), which counts in bytes */
+USB_STATIC_ASSERT(sizeof(usbStats_t) <= 255, statsLen);
+
+usbStats_t usbStats;
+/*
+ * The counters keep moving while the host reads them a packet at a time,
+ * so the request takes a copy and sends that instead.
+ */
+usbStats_t usbStatsSnapshot;
+
+void usbStatsClear()
+{
+	uint8_t *stats = (uint8_t *)&usbStats;
+	uint8_t i;
+	for (i = 0; i < sizeof(usbStats_t); ++i)
+		stats[i] = 0;
+}
+
+void usbHandleStatsRequest(volatile usbBDTEntry_t *BD)
+{
+	volatile usbSetupPacket_t *packet = addrToPtr(BD->address);
+	bool usbIE;
+
+	if (packet->requestType.type != USB_REQUEST_TYPE_VENDOR ||
+		packet->requestType.recipient != USB_RECIPIENT_DEVICE)
+		return;
+
+	/* In split mode the data endpoints' counters are updated from the interrupt, so hold it off */
+	usbIE = PIE3bits.USBIE;
+	PIE3bits.USBIE = 0;
+	switch (packet->request)
+	{
+		case USB_REQUEST_GET_STATS:
+			if (packet->requestType.direction != USB_DIR_IN)
+				break;
+			usbCopyFromMem((uint8_t *)&usbStatsSnapshot, (uint8_t *)&usbStats, sizeof(usbStats_t));
+			usbStatsSnapshot.version = USB_STATS_VERSION;
+			usbStatsSnapshot.endpoints = USB_STATS_ENDPOINTS;
+			if (packet->value.value == 1)
+				usbStatsClear();
+			usbStatusInEP[0].buffSrc = USB_BUFFER_SRC_MEM;
+			usbStatusInEP[0].buffer.memPtr = &usbStatsSnapshot;
+			usbStatusInEP[0].xferCount = sizeof(usbStats_t);
+			usbStatusInEP[0].needsArming = 1;
+			break;
+		case USB_REQUEST_CLEAR_STATS:
+			usbStatsClear();
+			/* Generate a reply that is 0 bytes long to acknowledge */
+			usbStatusInEP[0].needsArming = 1;
+			break;
+	}
+	PIE3bits.USBIE = usbIE;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * This file is part of PIC18DeviceUSB
+ * Copyright © 2015-2016 Rachel Mant (dx-mon@users.sourceforge.net)
+ *
+ * PIC18DeviceUSB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PIC18DeviceUSB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBSTATS_H
+#define	USBSTATS_H
+
+/*
+ * @file
+ * @author Rachel Mant
+ *
+ * @date 2026/10/17
+ */
+
+#ifdef	__cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include "usbTypes.h"
+#include "usbCDC.h"
+#include "usbRaw.h"
+
+/*
+ * With USB_STATS defined the stack keeps saturating traffic and error counters, which the host
+ * reads as a single usbStats_t with a vendor request to the device:
+ *   GET_STATS (bmRequestType 0xC0): returns the counters, clearing them too if wValue is 1.
+ *   CLEAR_STATS (bmRequestType 0x40): clears the counters.
+ * Counters run from usbInit() and are kept across bus resets and reconfigurations.
+ */
+#define USB_REQUEST_GET_STATS		0x01
+#define USB_REQUEST_CLEAR_STATS		0x02
+
+#define USB_STATS_VERSION			1
+
+/* Endpoints that have counters kept, which covers every endpoint the configuration uses */
+#ifndef USB_STATS_ENDPOINTS
+#ifdef USB_RAW_INTERFACE
+#define USB_STATS_ENDPOINTS			(USB_EP_RAW + 1)
+#else
+#define USB_STATS_ENDPOINTS			(USB_EP_CDC_NOTIFY(USB_CDC_PORTS - 1) + 1)
+#endif
+#endif
+
+/*
+ * Counters for one direction of an endpoint. unarmed counts the transactions that left the endpoint
+ * with no buffer descriptor armed, after which the host is NAKed until it is re-armed.
+ */
+typedef struct
+{
+	uint16_t packets;
+	uint16_t unarmed;
+	uint32_t bytes;
+} usbEPStats_t;
+
+/*
+ * The snapshot as sent to the host, all fields little endian. errors is indexed by UEIR bit:
+ * PID check, CRC5, CRC16, data field size, bus turnaround timeout and, at 7, bit stuff errors.
+ * sendHighWater is the deepest each CDC port's send queue has been.
+ */
+typedef struct
+{
+	uint8_t version;
+	uint8_t endpoints;
+	uint16_t errors[8];
+	uint8_t sendHighWater[USB_CDC_PORTS];
+	usbEPStats_t ep[USB_STATS_ENDPOINTS][2];
+} usbStats_t;
+
+extern void usbHandleStatsRequest(volatile usbBDTEntry_t *BD);
+
+extern usbStats_t usbStats;
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* USBSTATS_H */
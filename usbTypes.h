@@ -38,6 +38,10 @@ extern "C"
  * PID => Packet ID
  */
 
+#ifndef NULL
+#define NULL	((void *)0)
+#endif
+
 #define USB_ENDPOINTS			16
 #define USB_BDT_ENTRIES			64
 #define USB_BDT_ADDR			0x400
@@ -47,13 +51,16 @@ extern "C"
 #define USB_EP0_DATA_ADDR		0x508
 #define USB_EP0_DATA_LEN		8
 
-#define USB_EP1_OUT_ADDR		0x510
-#define USB_EP1_OUT_LEN			64
-#define USB_EP1_IN_ADDR			0x550
-#define USB_EP1_IN_LEN			64
+/* The region of dual-port RAM the SIE can transfer packets to and from directly */
+#define USB_RAM_ADDR			0x500
+#define USB_RAM_END				0x800
 
-#define USB_EP2_IN_ADDR			0x590
-#define USB_EP2_IN_LEN			64
+/* UEPn endpoint control register bits */
+#define USB_UEP_STALL			0x01
+#define USB_UEP_INEN			0x02
+#define USB_UEP_OUTEN			0x04
+#define USB_UEP_CONDIS			0x08
+#define USB_UEP_HSHK			0x10
 
 #define USB_DIR_OUT				0
 #define USB_DIR_IN				1
@@ -64,9 +71,71 @@ extern "C"
 
 #define USB_BUFFER_SRC_MEM		0
 #define USB_BUFFER_SRC_FLASH	1
+#define USB_BUFFER_SRC_USB_RAM	2
 
 #define USB_STATUS_TIMEOUT		45
 
+/* UIR and UIE bits for the interrupt sources the stack services */
+#define USB_IRQ_URST			0x01
+#define USB_IRQ_UERR			0x02
+#define USB_IRQ_ACTV			0x04
+#define USB_IRQ_TRN				0x08
+#define USB_IRQ_IDLE			0x10
+#define USB_IRQ_STALL			0x20
+#define USB_IRQ_SOF				0x40
+#define USB_IRQ_SOURCES			7
+
+/* The split interrupt mode is the deferred mode with data endpoints serviced straight from the interrupt */
+#if defined(USB_SPLIT_IRQ) && !defined(USB_DEFERRED_IRQ)
+#define USB_DEFERRED_IRQ
+#endif
+
+/*
+ * In split mode usbIRQ() can come in anywhere in usbTask() to service the data endpoints, so usbTask()
+ * holds it off with usbTaskLock() over just the two windows that change what that servicing works
+ * on: handling a deferred bus reset, and SET_CONFIGURATION taking down and re-arming the data
+ * endpoints. The rest of a control transaction only touches EP0, and the class drivers lock
+ * their own queues. In the other modes nothing can come in part way through, so these do nothing.
+ */
+#ifdef USB_SPLIT_IRQ
+#define usbTaskLock(state) \
+	state = PIE3bits.USBIE; \
+	PIE3bits.USBIE = 0
+#define usbTaskUnlock(state) PIE3bits.USBIE = state
+#else
+#define usbTaskLock(state)
+#define usbTaskUnlock(state)
+#endif
+
+/* The adaptive mode is the polled mode, handing over to the interrupt while the bus is quiet */
+#if defined(USB_ADAPTIVE_POLL) && !defined(USB_POLLED)
+#define USB_POLLED
+#endif
+#if defined(USB_POLLED) && defined(USB_DEFERRED_IRQ)
+#error "USB_POLLED cannot be used with USB_DEFERRED_IRQ or USB_SPLIT_IRQ"
+#endif
+
+/* Number of frames without a transaction after which the adaptive mode goes back to the interrupt */
+#ifndef USB_ADAPTIVE_IDLE_FRAMES
+#define USB_ADAPTIVE_IDLE_FRAMES	16
+#endif
+
+/* Interrupt priority usbAttach() gives the USB interrupt, 1 for high and 0 for low */
+#ifndef USB_IRQ_PRIORITY
+#define USB_IRQ_PRIORITY		1
+#endif
+
+/*
+ * Depth of the SIE's USTAT FIFO. One call into the stack services at most this many transactions,
+ * which bounds the time the interrupt spends on them however fast the host keeps them coming.
+ */
+#define USB_USTAT_FIFO_LEN		4
+
+/* Depth of the transaction queue between the interrupt and usbTask() in deferred mode, a power of two */
+#ifndef USB_XFER_QUEUE_LEN
+#define USB_XFER_QUEUE_LEN		8
+#endif
+
 typedef union
 {
 	uint8_t value;
@@ -79,17 +148,15 @@ typedef union
 	};
 } usbEP_t;
 
-typedef struct
-{
-	uint8_t length;
-	const void *descriptor;
-} usbMultiPartDesc_t;
+typedef void (*usbEPHandler_t)(void *context);
 
-typedef struct
+/* One piece of a scatter-gather IN transfer, source being one of the USB_BUFFER_SRC_* values */
+typedef struct usbSegment
 {
-	uint8_t numDesc;
-	const usbMultiPartDesc_t *descriptors;
-} usbMultiPartTable_t;
+	uint8_t source;
+	const void *data;
+	uint16_t len;
+} usbSegment_t;
 
 typedef struct
 {
@@ -99,9 +166,14 @@ typedef struct
 		struct
 		{
 			uint8_t needsArming : 1;
-			uint8_t buffSrc : 1;
-			uint8_t multiPart : 1;
-			uint8_t part : 4;
+			uint8_t buffSrc : 2;
+			uint8_t dataToggle : 1;
+			/* Which of the ping-pong buffer descriptors (bit 0 even, bit 1 odd) hold the last packet of a transfer */
+			uint8_t xferEnds : 2;
+			/* The transfer is gathered from the segment list at segment */
+			uint8_t gather : 1;
+			/* The last transfer ended on a packet boundary and still needs a ZLP to terminate it */
+			uint8_t zlpPending : 1;
 		};
 	};
 	union
@@ -112,11 +184,27 @@ typedef struct
 		const uint8_t *flashBuff;
 	} buffer;
 	usbEP_t ep;
+	/* How many of the endpoint's ping-pong buffer descriptors are currently owned by the SIE */
+	uint8_t armedCount;
+	/* Address in USB RAM of the endpoint's even packet buffer, the odd one directly follows it */
+	uint16_t buffAddr;
 	uint16_t xferCount;
 	uint16_t epLen;
-	uint8_t partCount;
-	const usbMultiPartTable_t *partDesc;
+	/* Set for streaming endpoints whose transfers should not be terminated with ZLPs */
+	uint8_t noZLP;
+	/*
+	 * The next segment of a gathered transfer and how much of the current one is left, which of the
+	 * buffer descriptors in xferEnds end a gathered transfer rather than one of the owner's, and what
+	 * to call when it completes instead of func
+	 */
+	const struct usbSegment *segment;
+	uint16_t segmentLeft;
+	uint8_t gatherEnds;
+	void (*gatherFunc)();
 	void (*func)();
+	/* What to call, and with what, when the SIE completes a transaction on the endpoint */
+	usbEPHandler_t handler;
+	void *context;
 } usbEPStatus_t;
 
 typedef union
@@ -276,7 +364,7 @@ typedef struct
 			uint8_t epNum : 4;
 			uint8_t : 3;
 			uint8_t epDir : 1;
-			uint8_t;
+			uint8_t : 8;
 		};
 	} index;
 	uint16_t length;
@@ -299,14 +387,17 @@ typedef enum
 #define USB_CLASS_DATA			0x0A
 #define USB_CLASS_MSD			0x08
 #define USB_CLASS_VENDOR		0xFF
+#define USB_CLASS_MISC			0xEF
 
 #define USB_SUBCLASS_NONE		0x00
 #define USB_SUBCLASS_ACM		0x02
 #define USB_SUBCLASS_MSD		0x06
 #define USB_SUBCLASS_VENDOR		0xFF
+#define USB_SUBCLASS_COMMON		0x02
 
 #define USB_PROTOCOL_NONE		0x00
 #define USB_PROTOCOL_V25_AT		0x01
+#define USB_PROTOCOL_IAD		0x01
 #define USB_PROTOCOL_TRANS		0x32
 #define USB_PROTOCOL_BULK_ONLY	0x50
 #define USB_PROTOCOL_CDC		0xFE
@@ -404,7 +495,15 @@ typedef enum
 	USB_DESCRIPTOR_INTERFACE_ASSOCIATION
 } usbDescriptor_t;
 
+/* Fails the build with a negative array size if cond does not hold */
+#define USB_STATIC_ASSERT(cond, name) typedef char usbStaticAssert_##name[(cond) ? 1 : -1]
+
+/* A host build's xc.h supplies its own mapping between pointers and data memory addresses */
+#ifndef addrToPtr
 #define addrToPtr(addr) ((void *)addr)
+#define ptrToAddr(ptr) ((uint16_t)ptr)
+#endif
+#define usbIsUSBRAM(ptr) (ptrToAddr(ptr) >= USB_RAM_ADDR && ptrToAddr(ptr) < USB_RAM_END)
 extern usbEPStatus_t usbStatusInEP[USB_ENDPOINTS];
 extern usbEPStatus_t usbStatusOutEP[USB_ENDPOINTS];
 /* Defines the buffer descriptor table and places it at it's fixed address in RAM */
@@ -31,15 +31,105 @@ extern "C"
 {
 #endif
 
+#include <stdint.h>
 #include <stdbool.h>
+#include "usbTypes.h"
 
-extern void usbUARTSendStringF(const char *str);
-extern void usbUARTSendStringM(char *str);
-extern void usbUARTSendChar(const char c);
+/*
+ * Every call takes the number of the CDC port it works on, from 0 to USB_CDC_PORTS - 1. Each port has
+ * its own buffering, flow control and DTR state, so one falling behind does not hold the others up.
+ */
+
+/*
+ * The send functions copy their data into the transmit stream, which packs consecutive writes
+ * into full packets and sends a part filled one after USB_CDC_FLUSH_FRAMES frames.
+ * They return false, having sent nothing, if there is not the room for the whole write.
+ */
+extern bool usbUARTSendStringF(const uint8_t portNum, const char *str);
+extern bool usbUARTSendStringM(const uint8_t portNum, char *str);
+extern bool usbUARTSendChar(const uint8_t portNum, const char c);
+/*
+ * Sends len bytes from buffer. When buffer lies in USB RAM and holds at least a packet's worth it is handed
+ * to the SIE in place and belongs to the stack until the sent callback fires for it, otherwise it is copied
+ * into the transmit stream. A USB RAM buffer shorter than a packet is packed into the stream, so is free
+ * again straight away, but still gets its sent callback once the packet it went into has gone.
+ * The sent callback runs from the USB interrupt once per completed USB RAM send, in the order they were queued.
+ */
+extern bool usbUARTSendBuffer(const uint8_t portNum, uint8_t *buffer, uint16_t len);
+/*
+ * Writes each of the segments to the transmit stream in turn, packing them together into
+ * full packets. Like the other send functions the segments are taken whole or not at all.
+ */
+extern bool usbUARTSendSegments(const uint8_t portNum, const usbSegment_t *segments, uint8_t count);
+/*
+ * Formats straight into the transmit stream. Supports %d, %i, %u, %x, %X (with l for long),
+ * %c, %s and %%, with an optional 0 flag and width. A precision on an integer conversion prints
+ * it as fixed-point with that many digits after the point, so ("%.2d", 1234) gives 12.34.
+ * Returns false if output had to be cut short for want of room.
+ */
+extern bool usbUARTPrintf(const uint8_t portNum, const char *format, ...);
+extern void usbUARTSetSentCallback(const uint8_t portNum, void (*func)());
 
-extern bool usbUARTDataSent();
-extern bool usbUARTHaveData();
-extern char usbUARTRecvChar();
+/* SET_CONTROL_LINE_STATE bits as returned by usbUARTControlLines() */
+#define USB_UART_LINE_DTR		0x01
+#define USB_UART_LINE_RTS		0x02
+
+/*
+ * What happens to writes while the host has DTR low, meaning no terminal has the port open:
+ * drop them and report them sent, keep just the newest USB_CDC_KEEP_LEN bytes to send once DTR
+ * goes high, block by refusing them so the send calls return false, or send them regardless.
+ * Every port starts out with USB_UART_DTR_SEND, which is how writes always behaved before DTR was tracked,
+ * so gating on DTR only happens for ports the application sets another policy on.
+ */
+#define USB_UART_DTR_DROP		0
+#define USB_UART_DTR_KEEP		1
+#define USB_UART_DTR_BLOCK		2
+#define USB_UART_DTR_SEND		3
+
+extern uint8_t usbUARTControlLines(const uint8_t portNum);
+extern void usbUARTSetDTRPolicy(const uint8_t portNum, const uint8_t policy);
+
+/* SERIAL_STATE bits, the DCD and DSR levels and the rest one-off events */
+#define USB_UART_STATE_DCD		0x01
+#define USB_UART_STATE_DSR		0x02
+#define USB_UART_STATE_BREAK	0x04
+#define USB_UART_STATE_RING		0x08
+#define USB_UART_STATE_FRAMING	0x10
+#define USB_UART_STATE_PARITY	0x20
+#define USB_UART_STATE_OVERRUN	0x40
+
+/*
+ * Report serial line state to the host through SERIAL_STATE notifications. Levels sets DCD and DSR,
+ * while events are reported once each. Changes made while a notification is in flight go out together in the next.
+ */
+extern void usbUARTSetSerialLevels(const uint8_t portNum, uint8_t levels);
+extern void usbUARTSignalSerialEvents(const uint8_t portNum, uint8_t events);
+
+/*
+ * With USB_CDC_UART_BRIDGE defined the data interface of port USB_CDC_BRIDGE_PORT is bridged to EUSART1 instead,
+ * and the send and receive calls here are not for use on that port. usbUARTBridgeIRQ() must be called from the interrupt handler for
+ * EUSART1's interrupts, which have to be at the same priority as the USB interrupt.
+ */
+extern void usbUARTBridgeIRQ();
+
+extern bool usbUARTDataSent(const uint8_t portNum);
+extern bool usbUARTHaveData(const uint8_t portNum);
+extern char usbUARTRecvChar(const uint8_t portNum);
+/*
+ * Returns how many received bytes can be read in place at *data, which stay put until consumed.
+ * A return of 0 means there is nothing to read. Consuming count bytes hands emptied packet slots back.
+ */
+extern uint8_t usbUARTPeek(const uint8_t portNum, const uint8_t **data);
+extern void usbUARTConsume(const uint8_t portNum, uint8_t count);
+/* Copies and consumes up to len received bytes into buffer, returning how many there were */
+extern uint16_t usbUARTRead(const uint8_t portNum, uint8_t *buffer, uint16_t len);
+/*
+ * Copies received bytes into buffer up to and including delim in a single pass, returning the
+ * length of the line or len if it did not fit. Until a whole line has arrived it returns 0, having
+ * consumed what it copied so far so that the packets it came in can be reused, and must be called
+ * again with the same buffer and len to carry on from there. Any other read in between abandons the partial line.
+ */
+extern uint16_t usbUARTReadUntil(const uint8_t portNum, uint8_t *buffer, uint16_t len, const char delim);
 
 #ifdef	__cplusplus
 }